@@ -0,0 +1,75 @@
+#!/bin/sh
+# Copyright © 2019 Jason Ekstrand
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Quick checks of ./persistence against things known some other way.
+# Run through "make check".
+
+PERSISTENCE=${PERSISTENCE:-./persistence}
+CENSUS_DIGITS=6
+failed=0
+
+fail()
+{
+    echo "FAIL: $*"
+    failed=1
+}
+
+# --census against counting every number up to CENSUS_DIGITS digits the
+# slow way.  Both are printed as "digits persistence count".
+census=$($PERSISTENCE --census --max-digits=$CENSUS_DIGITS 2>/dev/null |
+    awk '/^Numbers of [0-9]+ digits by persistence:$/ { digits = $3; next }
+         digits && /^[0-9]+:/ { print digits, $1 + 0, $2; next }
+         { digits = 0 }')
+brute=$(awk -v max=$CENSUS_DIGITS 'BEGIN {
+    for (n = 1; length(n) <= max; n++) {
+        p = 0
+        for (m = n; m >= 10; p++) {
+            q = 1
+            for (t = m; t; t = int(t / 10))
+                q *= t % 10
+            m = q
+        }
+        count[length(n) " " p]++
+    }
+    for (k in count)
+        print k, count[k]
+}' | sort -n -k1,1 -k2,2)
+if [ -z "$census" ] || [ "$census" != "$brute" ]; then
+    fail "--census doesn't match a brute-force count up to $CENSUS_DIGITS digits"
+fi
+
+# --verify, checking every candidate rather than a sample
+if ! $PERSISTENCE --verify --verify-sample=1 --max-digits=40 \
+        >/dev/null 2>&1; then
+    fail "--verify found numbers whose persistence is wrong"
+fi
+
+# Known smallest numbers of the highest persistence in a few bases,
+# given as the base, the persistence and the line printed for it
+while read -r base pers line; do
+    if ! $PERSISTENCE --base=$base --max-digits=30 2>/dev/null |
+            grep -qx "$pers:  $line"; then
+        fail "--base=$base doesn't find $line for persistence $pers"
+    fi
+done <<EOF
+10 11 2 7^6 8^6 9^2
+16 08 3 7^1 9^1 b^1 d^2
+EOF
+
+if [ $failed = 0 ]; then
+    echo "All checks passed"
+fi
+exit $failed
@@ -14,244 +14,7876 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
+/* For CPU affinity */
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <gmp.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <omp.h>
 #include <pthread.h>
 
+#include "persistence.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifdef __aarch64__
+#include <arm_neon.h>
+#endif
+
+#define MIN2(a, b) ((a) < (b) ? (a) : (b))
+#define MAX2(a, b) ((a) > (b) ? (a) : (b))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 #ifndef MAX_DIGITS
 #define MAX_DIGITS 100
 #endif
 
+/* Numbers with at most this many limbs are converted to decimal by peeling
+ * off a word-sized chunk of digits at a time.  That's O(n^2), but it lets
+ * us bail as soon as we see a zero in the low-order digits, which is
+ * nearly always.  Larger numbers go through mpn_get_str().  Where the two
+ * cross over depends on the CPU so a tuning file can move it.
+ */
+#ifndef CHUNKED_MAX_LIMBS
+#define CHUNKED_MAX_LIMBS 64
+#endif
+static unsigned chunked_max_limbs = CHUNKED_MAX_LIMBS;
+
+/* The largest power of 10 that fits in an unsigned long */
+#if ULONG_MAX > 0xfffffffful
+#define CHUNK_DIGITS 19
+#define CHUNK_BASE 10000000000000000000ul
+#else
+#define CHUNK_DIGITS 9
+#define CHUNK_BASE 1000000000ul
+#endif
+
+#define DIGIT_PAIR(n) { (n) / 10, (n) % 10 }
+#define DIGIT_PAIRS(t) \
+    DIGIT_PAIR((t) * 10 + 0), DIGIT_PAIR((t) * 10 + 1), \
+    DIGIT_PAIR((t) * 10 + 2), DIGIT_PAIR((t) * 10 + 3), \
+    DIGIT_PAIR((t) * 10 + 4), DIGIT_PAIR((t) * 10 + 5), \
+    DIGIT_PAIR((t) * 10 + 6), DIGIT_PAIR((t) * 10 + 7), \
+    DIGIT_PAIR((t) * 10 + 8), DIGIT_PAIR((t) * 10 + 9)
+
+static const unsigned char digit_pairs[100][2] = {
+    DIGIT_PAIRS(0), DIGIT_PAIRS(1), DIGIT_PAIRS(2), DIGIT_PAIRS(3),
+    DIGIT_PAIRS(4), DIGIT_PAIRS(5), DIGIT_PAIRS(6), DIGIT_PAIRS(7),
+    DIGIT_PAIRS(8), DIGIT_PAIRS(9),
+};
+
+static inline bool
+hist_digit_pair(unsigned hist[10], unsigned long pair)
+{
+    const unsigned char *digits = digit_pairs[pair];
+    if (digits[0] == 0 || digits[1] == 0)
+        return false;
+
+    hist[digits[0]]++;
+    hist[digits[1]]++;
+    return true;
+}
+
+/* Adds exactly CHUNK_DIGITS digits of r, including leading zeros, to the
+ * histogram.  Returns false if any of them is zero.
+ */
+static bool
+hist_chunk(unsigned hist[10], unsigned long r)
+{
+    for (unsigned i = 0; i < CHUNK_DIGITS / 2; i++) {
+        if (!hist_digit_pair(hist, r % 100))
+            return false;
+        r /= 100;
+    }
+
+#if CHUNK_DIGITS % 2
+    if (r == 0)
+        return false;
+    hist[r]++;
+#endif
+
+    return true;
+}
+
+/* Adds the digits of r to the histogram, not counting leading zeros.
+ * Returns false if any of them is zero.  r must be non-zero.
+ */
+static bool
+hist_top_chunk(unsigned hist[10], unsigned long r)
+{
+    assert(r > 0);
+
+    while (r >= 100) {
+        if (!hist_digit_pair(hist, r % 100))
+            return false;
+        r /= 100;
+    }
+
+    if (r >= 10)
+        return hist_digit_pair(hist, r);
+
+    hist[r]++;
+    return true;
+}
+
 /* Destroys in */
-static void
-mul_digits(mpz_t out, mpz_t in)
+static bool
+digit_hist_chunked(unsigned hist[10], mpz_t in)
 {
-    unsigned hist[10] = { 0, };
+    while (mpz_cmp_ui(in, CHUNK_BASE) >= 0) {
+        unsigned long r = mpz_tdiv_q_ui(in, in, CHUNK_BASE);
+        if (!hist_chunk(hist, r))
+            return false;
+    }
 
-    while (mpz_cmp_ui(in, 0) > 0) {
-        unsigned r = mpz_tdiv_q_ui(in, in, 10);
-        if (r == 0) {
-            mpz_set_ui(out, 0);
-            return;
+    return hist_top_chunk(hist, mpz_get_ui(in));
+}
+
+/* Histogram kernels for a flat buffer of decimal digits
+ *
+ * These take raw digit values (0-9, not ASCII) as produced by
+ * mpn_get_str() with no leading zeros.  They return false if the buffer
+ * contains a zero and otherwise add the count of each digit to hist.
+ * Nearly everything has a zero so the kernels scan the whole buffer for one
+ * before bothering to build the histogram.
+ *
+ * The kernel is picked at runtime based on what the CPU supports so that a
+ * binary built without -march=native still gets the vector paths.
+ */
+struct digit_kernel {
+    const char *name;
+    bool (*supported)(void);
+    bool (*hist)(unsigned hist[10], const unsigned char *digits, size_t len);
+};
+
+static bool
+digit_kernel_always_supported(void)
+{
+    return true;
+}
+
+static bool
+hist_digits_scalar(unsigned hist[10], const unsigned char *digits, size_t len)
+{
+    /* glibc's memchr is already vectorized */
+    if (memchr(digits, 0, len))
+        return false;
+
+    for (size_t i = 0; i < len; i++)
+        hist[digits[i]]++;
+
+    return true;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static bool
+digit_kernel_avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+}
+
+__attribute__((target("avx2,popcnt")))
+static bool
+hist_digits_avx2(unsigned hist[10], const unsigned char *digits, size_t len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t vec_len = len & ~(size_t)31;
+
+    __m256i any_zero = zero;
+    for (size_t i = 0; i < vec_len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(digits + i));
+        any_zero = _mm256_or_si256(any_zero, _mm256_cmpeq_epi8(v, zero));
+    }
+    if (!_mm256_testz_si256(any_zero, any_zero) ||
+        memchr(digits + vec_len, 0, len - vec_len))
+        return false;
+
+    for (size_t i = 0; i < vec_len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(digits + i));
+        for (unsigned d = 1; d < 10; d++) {
+            __m256i eq = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(d));
+            hist[d] += __builtin_popcount(_mm256_movemask_epi8(eq));
         }
-        hist[r]++;
     }
+    for (size_t i = vec_len; i < len; i++)
+        hist[digits[i]]++;
 
-    hist[2] += (hist[4] * 2) + hist[6] + (hist[8] * 3);
-    hist[3] += hist[6] + (hist[9] * 2);
+    return true;
+}
 
-    mpz_ui_pow_ui(out, 2, hist[2]);
+static bool
+digit_kernel_avx512_supported(void)
+{
+    return __builtin_cpu_supports("avx512bw") &&
+           __builtin_cpu_supports("popcnt");
+}
 
-    mpz_t pow;
-    mpz_init(pow);
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static bool
+hist_digits_avx512(unsigned hist[10], const unsigned char *digits, size_t len)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    size_t vec_len = len & ~(size_t)63;
 
-    if (hist[3]) {
-        mpz_ui_pow_ui(pow, 3, hist[3]);
-        mpz_mul(out, out, pow);
+    __mmask64 any_zero = 0;
+    for (size_t i = 0; i < vec_len; i += 64) {
+        __m512i v = _mm512_loadu_si512(digits + i);
+        any_zero |= _mm512_cmpeq_epi8_mask(v, zero);
     }
-    if (hist[5]) {
-        mpz_ui_pow_ui(pow, 5, hist[5]);
-        mpz_mul(out, out, pow);
-    }
-    if (hist[7]) {
-        mpz_ui_pow_ui(pow, 7, hist[7]);
-        mpz_mul(out, out, pow);
+    if (any_zero || memchr(digits + vec_len, 0, len - vec_len))
+        return false;
+
+    for (size_t i = 0; i < vec_len; i += 64) {
+        __m512i v = _mm512_loadu_si512(digits + i);
+        for (unsigned d = 1; d < 10; d++) {
+            __mmask64 eq = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(d));
+            hist[d] += __builtin_popcountll(eq);
+        }
     }
+    for (size_t i = vec_len; i < len; i++)
+        hist[digits[i]]++;
 
-    mpz_clear(pow);
+    return true;
 }
+#endif
 
-static unsigned
-mpz_persistence(mpz_t in)
+#ifdef __aarch64__
+/* NEON is baseline on aarch64 so there's nothing to check */
+static bool
+hist_digits_neon(unsigned hist[10], const unsigned char *digits, size_t len)
 {
-    mpz_t tmp;
-    mpz_init(tmp);
+    size_t vec_len = len & ~(size_t)15;
 
-    unsigned count;
-    for (count = 0; mpz_cmp_ui(in, 10) > 0; count++) {
-        mul_digits(tmp, in);
-        mpz_swap(tmp, in);
+    uint8x16_t any_zero = vdupq_n_u8(0);
+    for (size_t i = 0; i < vec_len; i += 16) {
+        uint8x16_t v = vld1q_u8(digits + i);
+        any_zero = vorrq_u8(any_zero, vceqzq_u8(v));
     }
+    if (vmaxvq_u8(any_zero) || memchr(digits + vec_len, 0, len - vec_len))
+        return false;
 
-    mpz_clear(tmp);
+    for (size_t i = 0; i < vec_len; i += 16) {
+        uint8x16_t v = vld1q_u8(digits + i);
+        for (unsigned d = 1; d < 10; d++) {
+            /* Each matching lane is 0xff, so this ends up with 1 per match */
+            uint8x16_t eq = vshrq_n_u8(vceqq_u8(v, vdupq_n_u8(d)), 7);
+            hist[d] += vaddvq_u8(eq);
+        }
+    }
+    for (size_t i = vec_len; i < len; i++)
+        hist[digits[i]]++;
 
-    return count;
+    return true;
 }
+#endif
 
-struct prefix {
-    const char *str;
-    unsigned digits;
-    unsigned prod;
+/* Sorted best to worst; the scalar kernel must come last. */
+static const struct digit_kernel digit_kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    { "avx512", digit_kernel_avx512_supported, hist_digits_avx512 },
+    { "avx2", digit_kernel_avx2_supported, hist_digits_avx2 },
+#endif
+#ifdef __aarch64__
+    { "neon", digit_kernel_always_supported, hist_digits_neon },
+#endif
+    { "scalar", digit_kernel_always_supported, hist_digits_scalar },
 };
+#define NUM_DIGIT_KERNELS (sizeof(digit_kernels) / sizeof(digit_kernels[0]))
 
-/** Unique prefixes which do not contain 7, 8, or 9
+static const struct digit_kernel *digit_kernel =
+    &digit_kernels[NUM_DIGIT_KERNELS - 1];
+
+/* Must be called before any threads are started */
+static void
+select_digit_kernel(void)
+{
+    for (unsigned i = 0; i < NUM_DIGIT_KERNELS; i++) {
+        if (digit_kernels[i].supported()) {
+            digit_kernel = &digit_kernels[i];
+            return;
+        }
+    }
+}
+
+/* After the first step, every product of digits is of the form
+ * 2^a * 3^b * 5^c * 7^d so we carry products around as exponent vectors
+ * whenever we can.
+ */
+#define NUM_PRIMES 4
+static const unsigned digit_primes[NUM_PRIMES] = { 2, 3, 5, 7 };
+enum { PRIME_2, PRIME_3, PRIME_5, PRIME_7 };
+
+/** Counters
  *
- * Given any number, we shrink it as far as possible by combining digits so
- * as to get 5s, 7s, 8s, and 8s on the right-hand side and one of the six
- * unique prefixes below on the left-hand side.  For instance, given the
- * number 7236, we can split the digits it into primes and re-combine and
- * get 479 which is the smallest number whose digets multiply to the same
- * value as 7236.  Using this scheme, and reforming all numbers as
- * <prefix>555777888999 where the number of 5s, 7s, 8s, and 8s varies, we
- * can get all unique products of digits with the smallest possible number.
- * This also gives us a very nice way to generate them.  I cannot take
- * credit for this; it was Matt Parker's idea:
- * https://www.youtube.com/watch?v=Wim9WJeDTHQ
+ * Each thread counts what it does in its own copy with plain increments.
+ * They get published at the end of every unit of work for whoever is
+ * reporting progress, and summed up once the thread is done.  Every field
+ * is a uint64_t so they can be handled as an array of words.
+ */
+enum persistence_phase {
+    /* Converting to decimal, including the histogram on the chunked path
+     * where the two are interleaved
+     */
+    PHASE_CONVERSION,
+    PHASE_HISTOGRAM,
+    /* Turning exponent vectors back into numbers */
+    PHASE_MULTIPLY,
+    NUM_PHASES,
+};
+
+static const char *const phase_names[NUM_PHASES] = {
+    "conversion", "histogram", "multiply",
+};
+
+/* Only one in 2^STATS_SAMPLE_SHIFT calls is timed since reading the clock
+ * costs about as much as a whole call on small numbers.
+ */
+#define STATS_SAMPLE_SHIFT 6
+#define STATS_MAX_STEP 16
+
+struct persistence_stats {
+    uint64_t candidates;
+    /* Candidates counted as pruned by the dead set */
+    uint64_t pruned;
+    /* Products of digits taken of bignums */
+    uint64_t conversions;
+    /* Of those, the ones too big for the chunked path which were settled
+     * by a zero in the low digits
+     */
+    uint64_t probe_rejects;
+    /* Exponent vectors turned back into bignums */
+    uint64_t multiplies;
+    /* Chains that ended in a zero, by the step which produced it.  Chains
+     * finished off by a cache hit aren't counted.
+     */
+    uint64_t zero_exits[STATS_MAX_STEP];
+    /* Estimated from the sampled calls */
+    uint64_t phase_ns[NUM_PHASES];
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    /* Lookups in the --product-store */
+    uint64_t store_hits;
+    uint64_t store_misses;
+};
+
+#define STATS_NUM_WORDS (sizeof(struct persistence_stats) / sizeof(uint64_t))
+
+static void
+persistence_stats_add(struct persistence_stats *dst,
+                      const struct persistence_stats *src)
+{
+    uint64_t *d = (uint64_t *)dst;
+    const uint64_t *s = (const uint64_t *)src;
+    for (unsigned i = 0; i < STATS_NUM_WORDS; i++)
+        __atomic_fetch_add(&d[i], s[i], __ATOMIC_RELAXED);
+}
+
+/* Copies src into dst where a reader may be looking at it */
+static void
+persistence_stats_publish(struct persistence_stats *dst,
+                          const struct persistence_stats *src)
+{
+    uint64_t *d = (uint64_t *)dst;
+    const uint64_t *s = (const uint64_t *)src;
+    for (unsigned i = 0; i < STATS_NUM_WORDS; i++)
+        __atomic_store_n(&d[i], s[i], __ATOMIC_RELAXED);
+}
+
+#ifndef PERSISTENCE_LIBRARY
+static void
+persistence_stats_sub(struct persistence_stats *dst,
+                      const struct persistence_stats *src)
+{
+    uint64_t *d = (uint64_t *)dst;
+    const uint64_t *s = (const uint64_t *)src;
+    for (unsigned i = 0; i < STATS_NUM_WORDS; i++)
+        d[i] -= s[i];
+}
+#endif
+
+/* Adds a published copy to dst, which must be private */
+static void
+persistence_stats_add_published(struct persistence_stats *dst,
+                                const struct persistence_stats *src)
+{
+    uint64_t *d = (uint64_t *)dst;
+    const uint64_t *s = (const uint64_t *)src;
+    for (unsigned i = 0; i < STATS_NUM_WORDS; i++)
+        d[i] += __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+}
+
+static inline void
+stats_zero_exit(struct persistence_stats *stats, unsigned step)
+{
+    stats->zero_exits[MIN2(step, STATS_MAX_STEP - 1)]++;
+}
+
+/** Per-thread scratch space
  *
- * When we do this reduction, we are left with six unique prefixes that can
- * end up at the front of the 7s, 8s, and 9s which I have in the list below
- * sorted smallest to largest.  Even though 26 looks like the largest, the
- * next 2-digit number will be a 2 followed by something that's at least a
- * 7 so it really does make sense.
+ * Everything the persistence computation needs beyond its input lives here
+ * and is sized up front for the largest number we'll see, so the inner
+ * loops never go to malloc.  With lots of threads, malloc contention was
+ * showing up in profiles.  It also carries the thread's counters.
  */
-#define NUM_PREFIXES 6
-struct prefix prefixes[NUM_PREFIXES] = {
-    { "26", 2,  12  },
-    { "2",  1,  2   },
-    { "3",  1,  3   },
-    { "4",  1,  4   },
-    { "6",  1,  6   },
-    { "",   0,  1   },
+struct workspace {
+    /* Powers of each of the digit primes */
+    mpz_t pow[NUM_PRIMES];
+    mpz_t prod;
+    /* Quotients for the zero probe */
+    mpz_t probe;
+    /* Decimal digits for mpn_get_str() */
+    unsigned char *str;
+    size_t str_size;
+
+    struct persistence_stats stats;
+    unsigned sample;
 };
 
-int
-main()
-{
-#define DIGIT_DIVISOR 100
-    const unsigned digit_bucket_count = MAX_DIGITS / DIGIT_DIVISOR + 1;
-    unsigned digits_left[digit_bucket_count];
-    for (unsigned i = 0; i < digit_bucket_count; i++) {
-        if ((i + 1) * DIGIT_DIVISOR > MAX_DIGITS)
-            digits_left[i] = MAX_DIGITS - i * DIGIT_DIVISOR;
-        else
-            digits_left[i] = DIGIT_DIVISOR;
+/* Returns the start time if this call should be timed and 0 otherwise */
+static inline uint64_t
+workspace_sample(struct workspace *ws)
+{
+    if (++ws->sample & ((1u << STATS_SAMPLE_SHIFT) - 1))
+        return 0;
+
+    return now_ns();
+}
+
+/* Charges the time since *start to phase if we're sampling */
+static inline void
+workspace_phase_end(struct workspace *ws, enum persistence_phase phase,
+                    uint64_t *start)
+{
+    if (*start == 0)
+        return;
+
+    uint64_t now = now_ns();
+    ws->stats.phase_ns[phase] += (now - *start) << STATS_SAMPLE_SHIFT;
+    *start = now;
+}
+
+/* Number of bits needed for the product of the digits of, or any number
+ * derived from, a number with the given number of digits
+ */
+static mp_bitcnt_t
+digits_max_bits(unsigned digits)
+{
+    /* log2(9) < 4 */
+    return (mp_bitcnt_t)digits * 4 + GMP_NUMB_BITS;
+}
+
+static void
+workspace_init(struct workspace *ws, unsigned max_digits)
+{
+    const mp_bitcnt_t bits = digits_max_bits(max_digits);
+    for (unsigned i = 0; i < NUM_PRIMES; i++)
+        mpz_init2(ws->pow[i], bits);
+    mpz_init2(ws->prod, bits);
+    mpz_init2(ws->probe, bits);
+    ws->str_size = max_digits + 1;
+    ws->str = malloc(ws->str_size);
+    memset(&ws->stats, 0, sizeof(ws->stats));
+    ws->sample = 0;
+}
+
+static void
+workspace_finish(struct workspace *ws)
+{
+    for (unsigned i = 0; i < NUM_PRIMES; i++)
+        mpz_clear(ws->pow[i]);
+    mpz_clear(ws->prod);
+    mpz_clear(ws->probe);
+    free(ws->str);
+}
+
+/* Converts in to a string of decimal digits with no leading zeros.
+ * Destroys in.
+ */
+static const unsigned char *
+digit_str(mpz_t in, struct workspace *ws, size_t *len_out)
+{
+    /* Convert the whole thing to decimal in one go.  For large inputs,
+     * mpn_get_str() does a divide-and-conquer split by a precomputed table
+     * of powers of 10 so this is roughly M(n) log n.  It clobbers its input
+     * but we're allowed to destroy in anyway.
+     */
+    size_t str_size = mpz_sizeinbase(in, 10) + 1;
+    if (str_size > ws->str_size) {
+        ws->str_size = str_size;
+        ws->str = realloc(ws->str, str_size);
     }
-    /* We start the loop at 2 but run it to a round number (not minus 1) */
-    digits_left[0] -= 1;
+    unsigned char *str = ws->str;
+    mp_size_t size = mpz_size(in);
+    size_t len = mpn_get_str(str, 10, mpz_limbs_modify(in, size), size);
+    mpz_limbs_finish(in, 0);
 
-    /* Only list things with a persistence of more than 2. */
-    unsigned max = 2;
+    /* mpn_get_str() may leave leading zeros so skip those. */
+    size_t i = 0;
+    while (i < len && str[i] == 0)
+        i++;
 
-#ifdef USE_OPENMP
-    pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
-    #pragma omp parallel for schedule(dynamic)
+    *len_out = len - i;
+    return str + i;
+}
+
+/* Before converting a number too big for the chunked path, we peel this
+ * many chunks off the low end looking for a zero.  Each chunk is one
+ * linear pass and has a zero in 1 - 0.9^19 = 86% of random numbers so,
+ * with four of them, only one number in a few thousand still needs the
+ * full conversion.  Those are mostly the ones we care about anyway.
+ */
+#ifndef ZERO_PROBE_CHUNKS
+#define ZERO_PROBE_CHUNKS 4
 #endif
-    for (unsigned digits = 2; digits <= MAX_DIGITS; digits++) {
-        mpz_t num, pow;
-        mpz_init(num);
-        mpz_init(pow);
 
-        for (unsigned p = 0; p < NUM_PREFIXES; p++) {
-            struct prefix *prefix = &prefixes[p];
-            if (digits < prefix->digits)
-                continue;
+/* Returns true if one of the lowest ZERO_PROBE_CHUNKS chunks of in contains
+ * a zero.  Doesn't modify in.
+ */
+static bool
+digit_probe_zero(const mpz_t in, struct workspace *ws)
+{
+    /* mpz_sizeinbase() may be one too big and a leading zero in the top
+     * chunk would look like a real one.
+     */
+    if (mpz_sizeinbase(in, 10) <= ZERO_PROBE_CHUNKS * CHUNK_DIGITS + 1)
+        return false;
 
-            if (prefix->prod & 1) {
-                /* If the prefix product is odd, then it's possible we may
-                 * have one which contains a 5.  Those numbers will not,
-                 * however, contain any 8s because 8 * 5 is a multiple of
-                 * 10 and the sum of the digits of any number which is a
-                 * multiple of 10 is zero.
-                 */
-                unsigned num579s = digits - prefix->digits;
-                /* Use strict inequality here so we get at least one 5.
-                 * The cases without 5s will be checked below.
-                 */
-                for (unsigned num79s = 0; num79s < num579s; num79s++) {
-                    unsigned num5s = num579s - num79s;
-                    for (unsigned num9s = 0; num9s <= num79s; num9s++) {
-                        unsigned num7s = num79s - num9s;
-
-                        /* Compute the first step */
-                        mpz_ui_pow_ui(num, 5, num5s);
-                        mpz_ui_pow_ui(pow, 7, num7s);
-                        mpz_mul(num, num, pow);
-                        mpz_ui_pow_ui(pow, 9, num9s);
-                        mpz_mul(num, num, pow);
-                        mpz_mul_ui(num, num, prefix->prod);
-
-                        unsigned persistence = 1 + mpz_persistence(num);
-                        if (persistence > max) {
-#ifdef USE_OPENMP
-                            pthread_mutex_lock(&mtx);
-                            if (persistence <= max) {
-                                pthread_mutex_unlock(&mtx);
-                                continue;
-                            }
-#endif
-                            printf("%02u:  %s", persistence, prefix->str);
-                            for (unsigned i = 0; i < num5s; i++) printf("5");
-                            for (unsigned i = 0; i < num7s; i++) printf("7");
-                            for (unsigned i = 0; i < num9s; i++) printf("9");
-                            printf("\n");
-                            max = persistence;
-#ifdef USE_OPENMP
-                            pthread_mutex_unlock(&mtx);
-#endif
-                        }
-                    }
-                }
-            }
+    /* Most numbers fail on the first chunk and that only needs the
+     * remainder.
+     */
+    unsigned hist[10];
+    if (!hist_chunk(hist, mpz_tdiv_ui(in, CHUNK_BASE)))
+        return true;
 
-            unsigned num789s = digits - prefix->digits;
-            for (unsigned num89s = 0; num89s <= num789s; num89s++) {
-                unsigned num7s = num789s - num89s;
-                for (unsigned num9s = 0; num9s <= num89s; num9s++) {
-                    unsigned num8s = num89s - num9s;
-
-                    /* Compute the first step */
-                    mpz_ui_pow_ui(num, 7, num7s);
-                    mpz_ui_pow_ui(pow, 8, num8s);
-                    mpz_mul(num, num, pow);
-                    mpz_ui_pow_ui(pow, 9, num9s);
-                    mpz_mul(num, num, pow);
-                    mpz_mul_ui(num, num, prefix->prod);
-
-                    unsigned persistence = 1 + mpz_persistence(num);
-                    if (persistence > max) {
-#ifdef USE_OPENMP
-                        pthread_mutex_lock(&mtx);
-                        if (persistence <= max) {
-                            pthread_mutex_unlock(&mtx);
-                            continue;
-                        }
-#endif
-                        printf("%02u:  %s", persistence, prefix->str);
-                        for (unsigned i = 0; i < num7s; i++) printf("7");
-                        for (unsigned i = 0; i < num8s; i++) printf("8");
-                        for (unsigned i = 0; i < num9s; i++) printf("9");
-                        printf("\n");
-                        max = persistence;
-#ifdef USE_OPENMP
-                        pthread_mutex_unlock(&mtx);
-#endif
-                    }
-                }
-            }
-        }
+    mpz_tdiv_q_ui(ws->probe, in, CHUNK_BASE);
+    for (unsigned i = 1; i < ZERO_PROBE_CHUNKS; i++) {
+        if (!hist_chunk(hist, mpz_tdiv_q_ui(ws->probe, ws->probe,
+                                           CHUNK_BASE)))
+            return true;
+    }
 
-        mpz_clear(num);
-        mpz_clear(pow);
+    return false;
+}
 
-        unsigned digits_bucket = (digits - 1) / DIGIT_DIVISOR;
-        if (__sync_sub_and_fetch(&digits_left[digits_bucket], 1) == 0) {
-#ifdef USE_OPENMP
-            pthread_mutex_lock(&mtx);
-#endif
-            unsigned bucket_digits = (digits_bucket + 1) * DIGIT_DIVISOR;
-            if (bucket_digits > MAX_DIGITS)
-                bucket_digits = MAX_DIGITS;
+/* Computes the exponents of the product of the digits of in.  Returns false
+ * if the product is zero.  Destroys in.
+ */
+static bool
+digit_exps(unsigned exps[NUM_PRIMES], mpz_t in, struct workspace *ws)
+{
+    unsigned hist[10] = { 0, };
 
-            fprintf(stderr, "Finished searching at %u digits\n", bucket_digits);
-            fflush(stderr);
-#ifdef USE_OPENMP
-            pthread_mutex_unlock(&mtx);
-#endif
+    ws->stats.conversions++;
+    uint64_t start = workspace_sample(ws);
+
+    bool nonzero;
+    if (mpz_size(in) <= chunked_max_limbs) {
+        nonzero = digit_hist_chunked(hist, in);
+        workspace_phase_end(ws, PHASE_CONVERSION, &start);
+    } else if (digit_probe_zero(in, ws)) {
+        ws->stats.probe_rejects++;
+        nonzero = false;
+        workspace_phase_end(ws, PHASE_CONVERSION, &start);
+    } else {
+        size_t len;
+        const unsigned char *str = digit_str(in, ws, &len);
+        workspace_phase_end(ws, PHASE_CONVERSION, &start);
+        nonzero = digit_kernel->hist(hist, str, len);
+        workspace_phase_end(ws, PHASE_HISTOGRAM, &start);
+    }
+
+    if (!nonzero)
+        return false;
+
+    exps[0] = hist[2] + (hist[4] * 2) + hist[6] + (hist[8] * 3);
+    exps[1] = hist[3] + hist[6] + (hist[9] * 2);
+    exps[2] = hist[5];
+    exps[3] = hist[7];
+
+    return true;
+}
+
+/** NUMA placement
+ *
+ * On machines with more than one NUMA node, threads left to float between
+ * sockets end up reading their scratch space and the tables of powers from
+ * the far side.  So each search thread gets pinned to a CPU, with the
+ * threads dealt out over the nodes in turn.  It first touches its own
+ * per-thread state so that state lands on its node, and it reads the
+ * tables of powers from its node's own copy.  The topology comes from sysfs,
+ * restricted to the CPUs we're allowed to run on.  With a single node,
+ * nothing is pinned unless --numa=on asks for it.
+ */
+#define NUMA_MAX_NODES 64
+
+enum numa_mode {
+    NUMA_AUTO,
+    NUMA_ON,
+    NUMA_OFF,
+};
+
+struct numa_topology {
+    /* Whether search threads get pinned */
+    bool enabled;
+    /* Always at least one */
+    unsigned num_nodes;
+    /* Node number in sysfs and the CPUs we may use on each */
+    unsigned ids[NUMA_MAX_NODES];
+    unsigned num_cpus[NUMA_MAX_NODES];
+    unsigned *cpus[NUMA_MAX_NODES];
+};
+
+static struct numa_topology numa = { .num_nodes = 1, };
+/* Index into numa of the node the calling thread is pinned to */
+static __thread unsigned thread_numa_node;
+/* Search thread the calling thread is pinned as or -1 */
+static __thread int thread_numa_index = -1;
+
+#ifndef PERSISTENCE_LIBRARY
+/* Parses a list like "0-3,8-11" from sysfs */
+static bool
+numa_read_list(const char *path, cpu_set_t *set)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+
+    CPU_ZERO(set);
+    unsigned first, last;
+    bool ok = true;
+    while (ok && fscanf(f, "%u", &first) == 1) {
+        last = first;
+        int c = fgetc(f);
+        if (c == '-') {
+            ok = fscanf(f, "%u", &last) == 1;
+            c = fgetc(f);
         }
+        for (unsigned i = first; ok && i <= last && i < CPU_SETSIZE; i++)
+            CPU_SET(i, set);
+        if (c != ',')
+            break;
     }
+    fclose(f);
 
-    return 0;
+    return ok;
+}
+
+static void
+numa_add_node(unsigned id, const cpu_set_t *cpus)
+{
+    const unsigned n = numa.num_nodes++;
+    numa.ids[n] = id;
+    numa.num_cpus[n] = 0;
+    numa.cpus[n] = malloc(CPU_COUNT(cpus) * sizeof(*numa.cpus[n]));
+    for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, cpus))
+            numa.cpus[n][numa.num_cpus[n]++] = cpu;
+    }
 }
+
+/* Must be called before any threads are started */
+static void
+numa_init(enum numa_mode mode)
+{
+    cpu_set_t allowed, nodes;
+    if (mode == NUMA_OFF || sched_getaffinity(0, sizeof(allowed), &allowed))
+        return;
+
+    numa.num_nodes = 0;
+    if (numa_read_list("/sys/devices/system/node/online", &nodes)) {
+        for (unsigned id = 0; id < CPU_SETSIZE; id++) {
+            if (!CPU_ISSET(id, &nodes) || numa.num_nodes == NUMA_MAX_NODES)
+                continue;
+
+            char path[64];
+            cpu_set_t cpus;
+            snprintf(path, sizeof(path),
+                     "/sys/devices/system/node/node%u/cpulist", id);
+            if (!numa_read_list(path, &cpus))
+                continue;
+
+            CPU_AND(&cpus, &cpus, &allowed);
+            if (CPU_COUNT(&cpus))
+                numa_add_node(id, &cpus);
+        }
+    }
+    /* No sysfs or nothing we can run on in it */
+    if (numa.num_nodes == 0)
+        numa_add_node(0, &allowed);
+
+    numa.enabled = mode == NUMA_ON || numa.num_nodes > 1;
+}
+
+static void
+numa_finish(void)
+{
+    for (unsigned n = 0; n < numa.num_nodes; n++)
+        free(numa.cpus[n]);
+    numa = (struct numa_topology) { .num_nodes = 1, };
+}
+#endif
+
+/* Node that search thread index runs on */
+static unsigned
+numa_thread_node(unsigned index)
+{
+    return index % numa.num_nodes;
+}
+
+/* Pins the calling thread as search thread index.  Each OpenMP thread keeps
+ * its number from one parallel region to the next, so this only costs a
+ * system call the first time.
+ */
+static void
+numa_bind_thread(unsigned index)
+{
+    if (!numa.enabled || thread_numa_index == (int)index)
+        return;
+
+    const unsigned node = numa_thread_node(index);
+    const unsigned cpu = numa.cpus[node][(index / numa.num_nodes) %
+                                         numa.num_cpus[node]];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    /* Running anywhere is better than not running */
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    thread_numa_node = node;
+    thread_numa_index = index;
+}
+
+/** Tables of powers of the odd digit primes
+ *
+ * Building a product from its exponents or starting a row of candidates
+ * takes powers of 3, 5 and 7 with exponents bounded by a small multiple of
+ * the number of digits.  Rather than recomputing them every time, we keep
+ * a table of them shared by all threads on a NUMA node, each node building
+ * its own copy.  Powers of 2 and 8 are shifts and powers of 9 are even
+ * powers of 3 so those don't need tables.
+ *
+ * Entries are built the first time somebody asks for them and published
+ * with a compare-and-swap; if two threads race, the loser throws its copy
+ * away.  Once published an entry is never written again so readers don't
+ * need any locking.  The total size of the entries of each copy is capped
+ * and anything past the cap is computed on demand instead.
+ */
+struct power_table {
+    unsigned size;
+    mpz_ptr *entries;
+};
+
+static struct power_table power_tables[NUMA_MAX_NODES][NUM_PRIMES];
+static size_t power_table_bytes[NUMA_MAX_NODES];
+static size_t power_table_max_bytes;
+/* Library contexts keep the tables warm between searches */
+static unsigned power_table_users;
+
+/* Must be called before any threads are started.  If the tables are
+ * already in use, they're shared as they are.
+ */
+static void
+power_tables_init(unsigned max_digits, size_t max_bytes)
+{
+    if (power_table_users++)
+        return;
+
+    /* Nine contributes two 3s per digit, 5 and 7 at most one */
+    for (unsigned n = 0; n < numa.num_nodes; n++) {
+        struct power_table *tables = power_tables[n];
+        for (unsigned i = PRIME_3; i < NUM_PRIMES; i++) {
+            tables[i].size = (i == PRIME_3 ? 2 : 1) * max_digits + 1;
+            tables[i].entries = calloc(tables[i].size,
+                                       sizeof(*tables[i].entries));
+        }
+        power_table_bytes[n] = 0;
+    }
+    power_table_max_bytes = max_bytes;
+}
+
+static void
+power_tables_finish(void)
+{
+    if (--power_table_users)
+        return;
+
+    for (unsigned n = 0; n < NUMA_MAX_NODES; n++) {
+        struct power_table *tables = power_tables[n];
+        for (unsigned i = PRIME_3; i < NUM_PRIMES; i++) {
+            for (unsigned e = 0; e < tables[i].size; e++) {
+                if (tables[i].entries[e]) {
+                    mpz_clear(tables[i].entries[e]);
+                    free(tables[i].entries[e]);
+                }
+            }
+            free(tables[i].entries);
+            tables[i] = (struct power_table) { 0, };
+        }
+    }
+}
+
+/* Returns digit_primes[prime]^exp.  The result is either a table entry or
+ * tmp, which gets clobbered.
+ */
+static mpz_srcptr
+power_get(unsigned prime, unsigned exp, mpz_ptr tmp)
+{
+    assert(prime != PRIME_2 && prime < NUM_PRIMES);
+    struct power_table *table = &power_tables[thread_numa_node][prime];
+    size_t *table_bytes = &power_table_bytes[thread_numa_node];
+
+    if (exp >= table->size) {
+        mpz_ui_pow_ui(tmp, digit_primes[prime], exp);
+        return tmp;
+    }
+
+    mpz_ptr entry = __atomic_load_n(&table->entries[exp], __ATOMIC_ACQUIRE);
+    if (entry)
+        return entry;
+
+    /* Reserve the space up front so racing threads can't overshoot */
+    const size_t bytes = sizeof(*entry) + sizeof(mp_limb_t) *
+        DIV_ROUND_UP(exp * 3 + 1, GMP_NUMB_BITS);
+    if (__atomic_load_n(table_bytes, __ATOMIC_RELAXED) + bytes >
+        power_table_max_bytes) {
+        mpz_ui_pow_ui(tmp, digit_primes[prime], exp);
+        return tmp;
+    }
+    if (__atomic_add_fetch(table_bytes, bytes, __ATOMIC_RELAXED) >
+        power_table_max_bytes) {
+        __atomic_sub_fetch(table_bytes, bytes, __ATOMIC_RELAXED);
+        mpz_ui_pow_ui(tmp, digit_primes[prime], exp);
+        return tmp;
+    }
+
+    mpz_ptr new_entry = malloc(sizeof(*new_entry));
+    mpz_init(new_entry);
+    mpz_ui_pow_ui(new_entry, digit_primes[prime], exp);
+    if (__atomic_compare_exchange_n(&table->entries[exp], &entry, new_entry,
+                                    false, __ATOMIC_RELEASE,
+                                    __ATOMIC_ACQUIRE))
+        return new_entry;
+
+    /* Someone beat us to it */
+    mpz_clear(new_entry);
+    free(new_entry);
+    __atomic_sub_fetch(table_bytes, bytes, __ATOMIC_RELAXED);
+    return entry;
+}
+
+/* Below this many limbs in total, the order in which exps_to_mpz()
+ * multiplies the powers makes no measurable difference.  Above it,
+ * multiplying the smallest first wins by around 10% at 4k digits and 35%
+ * at 300k digits.
+ */
+#ifndef PRODUCT_TREE_MIN_LIMBS
+#define PRODUCT_TREE_MIN_LIMBS 32
+#endif
+
+static void
+exps_to_mpz(mpz_t out, const unsigned exps[NUM_PRIMES], struct workspace *ws)
+{
+    ws->stats.multiplies++;
+    uint64_t start = workspace_sample(ws);
+
+    mpz_srcptr factors[NUM_PRIMES];
+    unsigned num_factors = 0;
+    size_t limbs = 0;
+    for (unsigned i = PRIME_3; i < NUM_PRIMES; i++) {
+        if (exps[i]) {
+            factors[num_factors] = power_get(i, exps[i], ws->pow[i]);
+            limbs += mpz_size(factors[num_factors]);
+            num_factors++;
+        }
+    }
+
+    /* Multiply the smallest factors together first so the operands stay
+     * balanced, which is what GMP's Toom and FFT multiplication like best.
+     * With only three odd primes, this is already the optimal tree.
+     */
+    if (limbs >= PRODUCT_TREE_MIN_LIMBS) {
+        for (unsigned i = 1; i < num_factors; i++) {
+            for (unsigned j = i; j > 0 &&
+                 mpz_size(factors[j]) < mpz_size(factors[j - 1]); j--) {
+                mpz_srcptr tmp = factors[j];
+                factors[j] = factors[j - 1];
+                factors[j - 1] = tmp;
+            }
+        }
+    }
+
+    if (num_factors == 0) {
+        mpz_set_ui(out, 1);
+    } else if (num_factors == 1) {
+        mpz_set(out, factors[0]);
+    } else {
+        /* mpz_mul() needs a temporary if the output aliases an input so
+         * multiply into prod and swap instead.
+         */
+        mpz_mul(out, factors[0], factors[1]);
+        for (unsigned i = 2; i < num_factors; i++) {
+            mpz_mul(ws->prod, out, factors[i]);
+            mpz_swap(out, ws->prod);
+        }
+    }
+
+    mpz_mul_2exp(out, out, exps[PRIME_2]);
+
+    workspace_phase_end(ws, PHASE_MULTIPLY, &start);
+}
+
+/** Fixed-width fast path
+ *
+ * The products shrink quickly: after a step or two they fit in a machine
+ * integer, at which point the rest of the chain is cheaper to do natively
+ * than with GMP.  We only go native below 2^NATIVE_BITS, which is below
+ * 10^NATIVE_DIGITS.  The product of the digits of anything that small is
+ * at most 9^NATIVE_DIGITS which is also below 2^NATIVE_BITS so once we're
+ * native we stay native.
+ */
+#ifdef __SIZEOF_INT128__
+typedef unsigned __int128 native_uint;
+#define NATIVE_BITS 126
+#else
+typedef uint64_t native_uint;
+#define NATIVE_BITS 63
+#endif
+
+#define DIGIT_PAIR_PROD(n) (((n) / 10) * ((n) % 10))
+#define DIGIT_PAIR_PRODS(t) \
+    DIGIT_PAIR_PROD((t) * 10 + 0), DIGIT_PAIR_PROD((t) * 10 + 1), \
+    DIGIT_PAIR_PROD((t) * 10 + 2), DIGIT_PAIR_PROD((t) * 10 + 3), \
+    DIGIT_PAIR_PROD((t) * 10 + 4), DIGIT_PAIR_PROD((t) * 10 + 5), \
+    DIGIT_PAIR_PROD((t) * 10 + 6), DIGIT_PAIR_PROD((t) * 10 + 7), \
+    DIGIT_PAIR_PROD((t) * 10 + 8), DIGIT_PAIR_PROD((t) * 10 + 9)
+
+static const unsigned char digit_pair_prods[100] = {
+    DIGIT_PAIR_PRODS(0), DIGIT_PAIR_PRODS(1), DIGIT_PAIR_PRODS(2),
+    DIGIT_PAIR_PRODS(3), DIGIT_PAIR_PRODS(4), DIGIT_PAIR_PRODS(5),
+    DIGIT_PAIR_PRODS(6), DIGIT_PAIR_PRODS(7), DIGIT_PAIR_PRODS(8),
+    DIGIT_PAIR_PRODS(9),
+};
+
+/* Returns the product of the digits of v, not counting leading zeros */
+static inline uint64_t
+u64_digit_prod(uint64_t v)
+{
+    uint64_t prod = 1;
+    while (v >= 100) {
+        prod *= digit_pair_prods[v % 100];
+        if (prod == 0)
+            return 0;
+        v /= 100;
+    }
+
+    if (v >= 10)
+        return prod * digit_pair_prods[v];
+
+    return prod * v;
+}
+
+static inline native_uint
+native_digit_prod(native_uint v)
+{
+#ifdef __SIZEOF_INT128__
+    if (v >> 64) {
+        /* v is below 10^38 so both halves fit in 64 bits.  The high half
+         * is non-zero so the low half has all 19 digits, any leading ones
+         * of which are zero.
+         */
+        const uint64_t base = 10000000000000000000ull;
+        uint64_t hi = v / base, lo = v % base;
+        if (lo < base / 10)
+            return 0;
+
+        uint64_t lo_prod = u64_digit_prod(lo);
+        if (lo_prod == 0)
+            return 0;
+
+        return (native_uint)lo_prod * u64_digit_prod(hi);
+    }
+#endif
+
+    return u64_digit_prod(v);
+}
+
+/* Same as mpz_persistence() for numbers below 2^NATIVE_BITS */
+static unsigned
+native_persistence(native_uint v, bool *zero)
+{
+    unsigned count = 0;
+    while (v >= 10) {
+        v = native_digit_prod(v);
+        count++;
+    }
+
+    *zero = count > 0 && v == 0;
+    return count;
+}
+
+static bool
+mpz_to_native(const mpz_t in, native_uint *out)
+{
+    if (mpz_sizeinbase(in, 2) > NATIVE_BITS)
+        return false;
+
+    /* The shift is split in two so it's defined even when a limb is as
+     * wide as native_uint, in which case there's only one limb anyway.
+     */
+    native_uint v = 0;
+    for (mp_size_t i = mpz_size(in); i-- > 0;)
+        v = (v << (GMP_NUMB_BITS / 2) << (GMP_NUMB_BITS / 2)) |
+            mpz_getlimbn(in, i);
+
+    *out = v;
+    return true;
+}
+
+/* Like exps_to_mpz() but fails if the result doesn't fit natively */
+static bool
+exps_to_native(const unsigned exps[NUM_PRIMES], native_uint *out)
+{
+    /* Every prime is at least 2 so this is a cheap lower bound on the size */
+    unsigned min_bits = 0;
+    for (unsigned i = 0; i < NUM_PRIMES; i++)
+        min_bits += exps[i];
+    if (min_bits > NATIVE_BITS)
+        return false;
+
+    native_uint v = 1;
+    for (unsigned i = 0; i < NUM_PRIMES; i++) {
+        for (unsigned j = 0; j < exps[i]; j++) {
+            if (__builtin_mul_overflow(v, digit_primes[i], &v))
+                return false;
+        }
+    }
+    if (v >> NATIVE_BITS)
+        return false;
+
+    *out = v;
+    return true;
+}
+
+/** Cache of the persistence of products of digits
+ *
+ * Lots of different candidates end up with the same product of digits so
+ * we remember the persistence of each product we've seen, keyed on its
+ * exponent vector.  The cache is a fixed-size open-addressed hash table of
+ * 64-bit entries, each of which packs the four exponents (15 bits each)
+ * and the persistence (4 bits).  Threads only ever read and write whole
+ * entries atomically so no locking is needed.  An entry may get evicted by
+ * a different key but, since a key always maps to the same persistence, a
+ * reader can never see a wrong value.  Keys which don't fit just aren't
+ * cached.
+ */
+#ifndef CACHE_BITS
+#define CACHE_BITS 20
+#endif
+#define CACHE_MAX_PROBE 8
+#define CACHE_EXP_BITS 15
+#define CACHE_VALUE_BITS 4
+
+/* NULL disables the cache */
+static uint64_t *persistence_cache;
+
+
+static bool
+exps_cache_key(const unsigned exps[NUM_PRIMES], uint64_t *key)
+{
+    *key = 0;
+    for (unsigned i = 0; i < NUM_PRIMES; i++) {
+        if (exps[i] >= (1u << CACHE_EXP_BITS))
+            return false;
+        *key = (*key << CACHE_EXP_BITS) | exps[i];
+    }
+
+    /* The empty product is trivial and its entry would look empty */
+    return *key != 0;
+}
+
+static inline uint64_t
+cache_hash(uint64_t key)
+{
+    return (key * 0x9e3779b97f4a7c15ull) >> (64 - CACHE_BITS);
+}
+
+static bool
+cache_lookup(uint64_t key, unsigned *persistence)
+{
+    uint64_t h = cache_hash(key);
+    for (unsigned i = 0; i < CACHE_MAX_PROBE; i++) {
+        uint64_t *slot = &persistence_cache[(h + i) & ((1ull << CACHE_BITS) - 1)];
+        uint64_t entry = __atomic_load_n(slot, __ATOMIC_RELAXED);
+        if (entry == 0)
+            return false;
+
+        if ((entry >> CACHE_VALUE_BITS) == key) {
+            *persistence = entry & ((1u << CACHE_VALUE_BITS) - 1);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void
+cache_insert(uint64_t key, unsigned persistence)
+{
+    if (persistence >= (1u << CACHE_VALUE_BITS))
+        return;
+
+    uint64_t new_entry = (key << CACHE_VALUE_BITS) | persistence;
+    uint64_t h = cache_hash(key);
+    for (unsigned i = 0; i < CACHE_MAX_PROBE; i++) {
+        uint64_t *slot = &persistence_cache[(h + i) & ((1ull << CACHE_BITS) - 1)];
+        uint64_t entry = 0;
+        if (__atomic_compare_exchange_n(slot, &entry, new_entry, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return;
+
+        /* Someone beat us to it */
+        if ((entry >> CACHE_VALUE_BITS) == key)
+            return;
+    }
+
+    /* No free slot in the probe window; evict whatever is in the home slot */
+    __atomic_store_n(&persistence_cache[h], new_entry, __ATOMIC_RELAXED);
+}
+
+/** Writing files
+ *
+ * Every file we keep state in is written to path.tmp and renamed over the
+ * old one so nobody reads half of it.  The new file is synced before the
+ * rename so a crash can't leave a truncated or empty one there instead.
+ */
+typedef bool (*write_file_fn)(FILE *f, void *data);
+
+/* Writes path with write(), which returns false if it couldn't write
+ * everything.  what says what the file is if that fails.
+ */
+static bool
+atomic_write_file(const char *path, const char *what, write_file_fn write,
+                  void *data)
+{
+    size_t tmp_path_len = strlen(path) + 5;
+    char *tmp_path = malloc(tmp_path_len);
+    snprintf(tmp_path, tmp_path_len, "%s.tmp", path);
+
+    bool ok = false;
+    FILE *f = fopen(tmp_path, "w");
+    if (f) {
+        ok = write(f, data) && !ferror(f);
+        ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+        ok = fclose(f) == 0 && ok;
+        ok = ok && rename(tmp_path, path) == 0;
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Failed to write %s %s: %s\n", what, path,
+                strerror(errno));
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+
+    return ok;
+}
+
+/** On-disk store of evaluated products
+ *
+ * The cache above starts out empty every run, yet extending a search to
+ * more digits goes back over most of the products the last one evaluated.
+ * With --product-store, the products too big for the native path are kept
+ * along with their persistence in a file which later runs map read-only
+ * and check before doing the work again.
+ *
+ * The file is a header followed by runs, each one a count and then that
+ * many cache entries sorted by key.  Every search that learned something
+ * appends a run under an exclusive flock() so that processes on a node can
+ * share one store, while readers only ever see the runs that were there
+ * when they mapped it.  A run cut short by a crash is ignored and written
+ * over by the next one.  Once there are STORE_MAX_RUNS runs they're merged
+ * into a new file which replaces the old one; whoever has the old one
+ * mapped keeps using it.  Since it never leaves the node, everything is in
+ * native byte order.
+ */
+#define STORE_VERSION 1
+#define STORE_MAX_RUNS 8
+
+struct store_header {
+    char magic[24];
+    uint32_t version;
+    /* How the entries are packed, see exps_cache_key() and cache_insert() */
+    uint16_t exp_bits;
+    uint16_t value_bits;
+};
+
+struct store_run {
+    const uint64_t *entries;
+    uint64_t len;
+};
+
+/* The store file as it was when it was mapped */
+struct store_view {
+    void *map;
+    size_t size;
+    struct store_run *runs;
+    unsigned num_runs;
+    uint64_t num_entries;
+    /* Offset just past the last complete run or 0 if there's no header */
+    uint64_t end;
+};
+
+/* Looked up by every thread; only changed before and after the search */
+static struct store_view product_store;
+/* Whether there's a store to save to, even if it's empty so far */
+static bool store_enabled;
+
+static bool
+store_view_lookup(const struct store_view *view, uint64_t key,
+                  unsigned *persistence)
+{
+    for (unsigned r = 0; r < view->num_runs; r++) {
+        const uint64_t *entries = view->runs[r].entries;
+        uint64_t lo = 0, hi = view->runs[r].len;
+        while (lo < hi) {
+            const uint64_t mid = lo + (hi - lo) / 2;
+            const uint64_t mid_key = entries[mid] >> CACHE_VALUE_BITS;
+            if (mid_key == key) {
+                *persistence = entries[mid] & ((1u << CACHE_VALUE_BITS) - 1);
+                return true;
+            }
+            if (mid_key < key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+    }
+
+    return false;
+}
+
+#ifndef PERSISTENCE_LIBRARY
+static const char store_magic[24] = "persistence-store\n";
+
+static bool
+store_view_map(struct store_view *view, int fd, const char *path)
+{
+    *view = (struct store_view) { NULL, };
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "Failed to read product store %s: %s\n", path,
+                strerror(errno));
+        return false;
+    }
+    if (st.st_size == 0)
+        return true;
+
+    view->size = st.st_size;
+    view->map = mmap(NULL, view->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (view->map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map product store %s: %s\n", path,
+                strerror(errno));
+        view->map = NULL;
+        return false;
+    }
+
+    const struct store_header *header = view->map;
+    if (view->size < sizeof(*header) ||
+        memcmp(header->magic, store_magic, sizeof(store_magic)) != 0 ||
+        header->version != STORE_VERSION) {
+        fprintf(stderr, "%s isn't a product store\n", path);
+        goto fail;
+    }
+    if (header->exp_bits != CACHE_EXP_BITS ||
+        header->value_bits != CACHE_VALUE_BITS) {
+        fprintf(stderr, "Product store %s was packed differently\n", path);
+        goto fail;
+    }
+
+    uint64_t offset = sizeof(*header);
+    while (view->size - offset >= sizeof(uint64_t)) {
+        const uint64_t *run = (const uint64_t *)((char *)view->map + offset);
+        const uint64_t room = (view->size - offset) / sizeof(uint64_t) - 1;
+        if (run[0] > room)
+            break;
+
+        if ((view->num_runs & (view->num_runs - 1)) == 0) {
+            view->runs = realloc(view->runs, MAX2(view->num_runs * 2, 1) *
+                                             sizeof(*view->runs));
+        }
+        view->runs[view->num_runs++] = (struct store_run) {
+            .entries = run + 1,
+            .len = run[0],
+        };
+        view->num_entries += run[0];
+        offset += (run[0] + 1) * sizeof(uint64_t);
+    }
+    view->end = offset;
+
+    return true;
+
+fail:
+    munmap(view->map, view->size);
+    view->map = NULL;
+    return false;
+}
+
+static void
+store_view_unmap(struct store_view *view)
+{
+    if (view->map)
+        munmap(view->map, view->size);
+    free(view->runs);
+    *view = (struct store_view) { NULL, };
+}
+
+/* Only the products that the native path can't do are worth storing */
+static bool
+store_key_wanted(uint64_t key)
+{
+    unsigned exps[NUM_PRIMES];
+    for (unsigned i = NUM_PRIMES; i-- > 0;) {
+        exps[i] = key & ((1u << CACHE_EXP_BITS) - 1);
+        key >>= CACHE_EXP_BITS;
+    }
+
+    native_uint v;
+    return !exps_to_native(exps, &v);
+}
+
+static int
+u64_cmp(const void *_a, const void *_b)
+{
+    const uint64_t a = *(const uint64_t *)_a, b = *(const uint64_t *)_b;
+    return a < b ? -1 : a > b;
+}
+
+/* Maps the store in path, if there is one yet */
+static bool
+store_open(const char *path)
+{
+    store_enabled = true;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return true;
+        fprintf(stderr, "Failed to open product store %s: %s\n", path,
+                strerror(errno));
+        return false;
+    }
+
+    /* The mapping outlives the descriptor */
+    bool ok = store_view_map(&product_store, fd, path);
+    close(fd);
+    return ok;
+}
+
+/* Replaces the store with a single run of everything in view and entries */
+struct store_run_data {
+    const uint64_t *entries;
+    uint64_t len;
+};
+
+/* Writes a store with just the one run */
+static bool
+store_write_run(FILE *f, void *data)
+{
+    const struct store_run_data *run = data;
+
+    struct store_header header = {
+        .version = STORE_VERSION,
+        .exp_bits = CACHE_EXP_BITS,
+        .value_bits = CACHE_VALUE_BITS,
+    };
+    memcpy(header.magic, store_magic, sizeof(store_magic));
+
+    return fwrite(&header, sizeof(header), 1, f) == 1 &&
+           fwrite(&run->len, sizeof(run->len), 1, f) == 1 &&
+           fwrite(run->entries, sizeof(*run->entries), run->len, f) ==
+           run->len;
+}
+
+static bool
+store_compact(const char *path, const struct store_view *view,
+              const uint64_t *entries, size_t num_entries)
+{
+    size_t len = 0;
+    uint64_t *all = malloc((view->num_entries + num_entries) * sizeof(*all));
+    for (unsigned r = 0; r < view->num_runs; r++) {
+        memcpy(all + len, view->runs[r].entries,
+               view->runs[r].len * sizeof(*all));
+        len += view->runs[r].len;
+    }
+    memcpy(all + len, entries, num_entries * sizeof(*all));
+    len += num_entries;
+
+    qsort(all, len, sizeof(*all), u64_cmp);
+    size_t num_unique = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (num_unique == 0 || all[i] != all[num_unique - 1])
+            all[num_unique++] = all[i];
+    }
+
+    struct store_run_data run = { .entries = all, .len = num_unique };
+    const bool ok = atomic_write_file(path, "product store",
+                                      store_write_run, &run);
+    free(all);
+
+    return ok;
+}
+
+/* Adds whatever the cache has that the store doesn't to the end of it */
+static bool
+store_save(const char *path)
+{
+    size_t num_entries = 0;
+    uint64_t *entries = malloc(sizeof(*entries) << CACHE_BITS);
+    for (uint64_t i = 0; i < (1ull << CACHE_BITS); i++) {
+        const uint64_t entry = persistence_cache[i];
+        unsigned persistence;
+        if (entry && store_key_wanted(entry >> CACHE_VALUE_BITS) &&
+            !store_view_lookup(&product_store, entry >> CACHE_VALUE_BITS,
+                               &persistence))
+            entries[num_entries++] = entry;
+    }
+    if (num_entries == 0) {
+        free(entries);
+        return true;
+    }
+    qsort(entries, num_entries, sizeof(*entries), u64_cmp);
+
+    /* Whoever compacts the store swaps the file out from under us, so make
+     * sure the one we locked is still the one at path.
+     */
+    FILE *f;
+    while (true) {
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0 || flock(fd, LOCK_EX) < 0) {
+            fprintf(stderr, "Failed to lock product store %s: %s\n", path,
+                    strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            free(entries);
+            return false;
+        }
+
+        struct stat locked, current;
+        if (fstat(fd, &locked) == 0 && stat(path, &current) == 0 &&
+            locked.st_dev == current.st_dev &&
+            locked.st_ino == current.st_ino) {
+            f = fdopen(fd, "r+b");
+            break;
+        }
+        close(fd);
+    }
+
+    /* Others may have added some of ours since we mapped it */
+    struct store_view view;
+    bool ok = store_view_map(&view, fileno(f), path);
+    if (ok) {
+        size_t num_new = 0;
+        for (size_t i = 0; i < num_entries; i++) {
+            unsigned persistence;
+            if (!store_view_lookup(&view, entries[i] >> CACHE_VALUE_BITS,
+                                   &persistence))
+                entries[num_new++] = entries[i];
+        }
+        num_entries = num_new;
+    }
+
+    if (ok && num_entries > 0 && view.num_runs + 1 >= STORE_MAX_RUNS) {
+        ok = store_compact(path, &view, entries, num_entries);
+    } else if (ok && num_entries > 0) {
+        struct store_header header = {
+            .version = STORE_VERSION,
+            .exp_bits = CACHE_EXP_BITS,
+            .value_bits = CACHE_VALUE_BITS,
+        };
+        memcpy(header.magic, store_magic, sizeof(store_magic));
+        const uint64_t run_len = num_entries;
+
+        /* Drop any run that was cut short */
+        ok = ftruncate(fileno(f), view.end) == 0 &&
+             fseeko(f, view.end, SEEK_SET) == 0;
+        if (ok && view.end == 0)
+            ok = fwrite(&header, sizeof(header), 1, f) == 1;
+        ok = ok && fwrite(&run_len, sizeof(run_len), 1, f) == 1 &&
+             fwrite(entries, sizeof(*entries), num_entries, f) == num_entries;
+        ok = fflush(f) == 0 && ok;
+        if (!ok) {
+            fprintf(stderr, "Failed to write product store %s: %s\n", path,
+                    strerror(errno));
+        }
+    }
+
+    store_view_unmap(&view);
+    /* Also drops the lock */
+    fclose(f);
+    free(entries);
+
+    return ok;
+}
+
+static void
+store_close(void)
+{
+    store_view_unmap(&product_store);
+    store_enabled = false;
+}
+#endif
+
+/* Returns the number of steps it takes to get in down to a single digit.
+ * Sets *zero if the last step was seen to produce a zero.  Destroys in.
+ */
+static unsigned
+mpz_persistence(mpz_t in, struct workspace *ws, bool *zero)
+{
+    struct persistence_stats *stats = &ws->stats;
+
+    /* Cache keys of the products we've computed along the way and the step
+     * at which we computed them so we can fill in the cache at the end.
+     */
+#define MAX_CACHED_STEPS 16
+    uint64_t keys[MAX_CACHED_STEPS];
+    unsigned key_steps[MAX_CACHED_STEPS];
+    unsigned num_keys = 0;
+
+    native_uint v;
+    if (mpz_to_native(in, &v))
+        return native_persistence(v, zero);
+
+    *zero = false;
+    unsigned count = 0;
+    while (mpz_cmp_ui(in, 10) >= 0) {
+        unsigned exps[NUM_PRIMES];
+        bool nonzero = digit_exps(exps, in, ws);
+        count++;
+        if (!nonzero) {
+            *zero = true;
+            break;
+        }
+
+        uint64_t key;
+        const bool keyed = persistence_cache && exps_cache_key(exps, &key);
+        if (keyed) {
+            unsigned cached;
+            if (cache_lookup(key, &cached)) {
+                stats->cache_hits++;
+                count += cached;
+                break;
+            }
+            stats->cache_misses++;
+
+            if (num_keys < MAX_CACHED_STEPS) {
+                keys[num_keys] = key;
+                key_steps[num_keys] = count;
+                num_keys++;
+            }
+        }
+
+        if (exps_to_native(exps, &v)) {
+            count += native_persistence(v, zero);
+            break;
+        }
+
+        /* Only the products we'd otherwise have to build are stored */
+        if (keyed && product_store.num_runs) {
+            unsigned stored;
+            if (store_view_lookup(&product_store, key, &stored)) {
+                stats->store_hits++;
+                count += stored;
+                break;
+            }
+            stats->store_misses++;
+        }
+
+        exps_to_mpz(in, exps, ws);
+    }
+
+    for (unsigned i = 0; i < num_keys; i++)
+        cache_insert(keys[i], count - key_steps[i]);
+
+    return count;
+}
+
+/* Same as mpz_persistence() of the product with the given exponents, which
+ * only gets built if the store doesn't know it.  With a store, the result
+ * goes in the cache so it gets saved, same as on the path where the product
+ * is built by a step of mpz_persistence().
+ */
+static unsigned
+exps_persistence(mpz_t num, const unsigned exps[NUM_PRIMES],
+                 struct workspace *ws, bool *zero)
+{
+    uint64_t key;
+    native_uint v;
+    const bool keyed = store_enabled && persistence_cache &&
+                       !exps_to_native(exps, &v) &&
+                       exps_cache_key(exps, &key);
+
+    unsigned persistence;
+    if (keyed && product_store.num_runs) {
+        if (store_view_lookup(&product_store, key, &persistence)) {
+            ws->stats.store_hits++;
+            *zero = false;
+            return persistence;
+        }
+        ws->stats.store_misses++;
+    }
+
+    exps_to_mpz(num, exps, ws);
+    persistence = mpz_persistence(num, ws, zero);
+    if (keyed)
+        cache_insert(key, persistence);
+
+    return persistence;
+}
+
+/** Second-step products known to die young
+ *
+ * With --prune, we only care about candidates whose persistence is at
+ * least --min-persistence.  Whatever happens after the second step only
+ * depends on the exponent vector of the second product, and lots of
+ * candidates share one, so we keep a bitmap of the vectors whose chains
+ * are known to be too short.  A candidate which lands on one of them is
+ * counted as pruned without building the product or converting it.
+ * Unlike the cache above, nothing ever gets evicted and the bitmap can be
+ * saved with --prune-file for the next run to pick up.
+ *
+ * The bitmap covers exponents up to what a product of scale digits can
+ * have: 3 * scale 2s, 2 * scale 3s and scale each of 5s and 7s.  A vector
+ * with both a 2 and a 5 is a multiple of 10 and goes to zero at the next
+ * step, so those don't need bits and the 2s and 5s can share an axis.
+ * Vectors outside the box are never pruned.
+ */
+struct dead_set {
+    unsigned scale;
+    /* Persistence of the second product below which it's dead */
+    unsigned threshold;
+    /* --min-persistence the bits are for */
+    unsigned prune_below;
+    /* NULL disables pruning */
+    uint64_t *bits;
+};
+
+#define DEAD_SET_VERSION 2
+
+static struct dead_set dead_set;
+
+#ifndef PERSISTENCE_LIBRARY
+static uint64_t
+dead_set_num_bits(unsigned scale)
+{
+    return (uint64_t)(4 * scale + 1) * (2 * scale + 1) * (scale + 1);
+}
+
+static size_t
+dead_set_num_words(unsigned scale)
+{
+    return DIV_ROUND_UP(dead_set_num_bits(scale), 64);
+}
+#endif
+
+static bool
+dead_set_index(const unsigned exps[NUM_PRIMES], uint64_t *index)
+{
+    const unsigned scale = dead_set.scale;
+
+    unsigned t;
+    if (exps[PRIME_5] == 0) {
+        if (exps[PRIME_2] > 3 * scale)
+            return false;
+        t = exps[PRIME_2];
+    } else {
+        if (exps[PRIME_5] > scale)
+            return false;
+        t = 3 * scale + exps[PRIME_5];
+    }
+    if (exps[PRIME_3] > 2 * scale || exps[PRIME_7] > scale)
+        return false;
+
+    *index = ((uint64_t)t * (2 * scale + 1) + exps[PRIME_3]) * (scale + 1) +
+             exps[PRIME_7];
+    return true;
+}
+
+#ifndef PERSISTENCE_LIBRARY
+/* Inverse of dead_set_index() for a bitmap of the given scale */
+static void
+dead_set_exps(unsigned scale, uint64_t index, unsigned exps[NUM_PRIMES])
+{
+    exps[PRIME_7] = index % (scale + 1);
+    index /= scale + 1;
+    exps[PRIME_3] = index % (2 * scale + 1);
+    index /= 2 * scale + 1;
+    if (index <= 3 * scale) {
+        exps[PRIME_2] = index;
+        exps[PRIME_5] = 0;
+    } else {
+        exps[PRIME_2] = 0;
+        exps[PRIME_5] = index - 3 * scale;
+    }
+}
+#endif
+
+static void
+dead_set_set(const unsigned exps[NUM_PRIMES])
+{
+    uint64_t index;
+    if (dead_set_index(exps, &index)) {
+        __atomic_fetch_or(&dead_set.bits[index / 64], 1ull << (index % 64),
+                          __ATOMIC_RELAXED);
+    }
+}
+
+/* Returns true if a second product with the given exponents is known to
+ * have a persistence below dead_set.threshold.
+ */
+static bool
+dead_set_lookup(const unsigned exps[NUM_PRIMES])
+{
+    if (exps[PRIME_2] && exps[PRIME_5])
+        return dead_set.threshold > 1;
+
+    uint64_t index;
+    if (!dead_set_index(exps, &index))
+        return false;
+
+    uint64_t word = __atomic_load_n(&dead_set.bits[index / 64],
+                                    __ATOMIC_RELAXED);
+    return word & (1ull << (index % 64));
+}
+
+/* Records the persistence of a second product */
+static void
+dead_set_record(const unsigned exps[NUM_PRIMES], unsigned persistence)
+{
+    if (persistence < dead_set.threshold)
+        dead_set_set(exps);
+}
+
+#ifndef PERSISTENCE_LIBRARY
+/* Reads a bitmap saved by dead_set_save() into the current one, which may
+ * be of a different scale.
+ */
+static bool
+dead_set_load(FILE *f, unsigned scale)
+{
+    const size_t num_words = dead_set_num_words(scale);
+    uint64_t *bits = malloc(num_words * sizeof(*bits));
+    if (fread(bits, sizeof(*bits), num_words, f) != num_words) {
+        free(bits);
+        return false;
+    }
+
+    if (scale == dead_set.scale) {
+        memcpy(dead_set.bits, bits, num_words * sizeof(*bits));
+    } else {
+        const uint64_t num_bits = dead_set_num_bits(scale);
+        for (size_t i = 0; i < num_words; i++) {
+            for (uint64_t w = bits[i]; w; w &= w - 1) {
+                const uint64_t index = i * 64 + __builtin_ctzll(w);
+                if (index >= num_bits)
+                    break;
+
+                unsigned exps[NUM_PRIMES];
+                dead_set_exps(scale, index, exps);
+                dead_set_set(exps);
+            }
+        }
+    }
+
+    free(bits);
+    return true;
+}
+
+/* Sets up the dead set for prune_below, starting from the one saved in path
+ * if there is one.  Must be called before any threads are started.
+ */
+static bool
+dead_set_init(unsigned max_digits, unsigned prune_below, size_t max_bytes,
+              const char *path)
+{
+    /* Pick the biggest box which fits; the second product of a candidate
+     * has fewer digits than the candidate.
+     */
+    unsigned scale = max_digits;
+    while (scale > 0 && dead_set_num_words(scale) * 8 > max_bytes)
+        scale--;
+
+    FILE *f = NULL;
+    unsigned version, file_prune_below, file_scale;
+    if (path && (f = fopen(path, "rb")) == NULL && errno != ENOENT) {
+        fprintf(stderr, "Failed to open dead set %s: %s\n", path,
+                strerror(errno));
+        return false;
+    }
+    if (f) {
+        if (fscanf(f, "persistence-dead-set %u %u %u", &version,
+                   &file_prune_below, &file_scale) != 3 ||
+            version != DEAD_SET_VERSION || fgetc(f) != '\n')
+            goto fail_format;
+
+        /* A bitmap for a lower bound only has vectors which are dead for
+         * us too.  The other way around it would prune too much.
+         */
+        if (file_prune_below > prune_below) {
+            fprintf(stderr, "Dead set %s is for --min-persistence=%u or "
+                    "higher\n", path, file_prune_below);
+            fclose(f);
+            return false;
+        }
+
+        /* Don't throw away what an earlier, bigger search found */
+        if (file_scale > scale && dead_set_num_words(file_scale) * 8 <=
+                                  max_bytes)
+            scale = file_scale;
+    }
+
+    dead_set.scale = scale;
+    dead_set.threshold = prune_below > 2 ? prune_below - 2 : 0;
+    dead_set.prune_below = prune_below;
+    dead_set.bits = calloc(dead_set_num_words(scale), sizeof(*dead_set.bits));
+
+    if (f) {
+        if (!dead_set_load(f, file_scale)) {
+            free(dead_set.bits);
+            dead_set.bits = NULL;
+            goto fail_format;
+        }
+        fclose(f);
+    }
+
+    return true;
+
+fail_format:
+    fprintf(stderr, "Dead set %s is corrupt\n", path);
+    fclose(f);
+    return false;
+}
+
+static bool
+dead_set_write(FILE *f, void *data)
+{
+    (void)data;
+
+    const size_t num_words = dead_set_num_words(dead_set.scale);
+    fprintf(f, "persistence-dead-set %u %u %u\n", DEAD_SET_VERSION,
+            dead_set.prune_below, dead_set.scale);
+    return fwrite(dead_set.bits, sizeof(*dead_set.bits), num_words, f) ==
+           num_words;
+}
+
+static bool
+dead_set_save(const char *path)
+{
+    return atomic_write_file(path, "dead set", dead_set_write, NULL);
+}
+
+static void
+dead_set_finish(void)
+{
+    free(dead_set.bits);
+    dead_set = (struct dead_set) { 0, };
+}
+#endif
+
+struct prefix {
+    const char *str;
+    unsigned digits;
+    unsigned prod;
+};
+
+/** Unique prefixes which do not contain 7, 8, or 9
+ *
+ * Given any number, we shrink it as far as possible by combining digits so
+ * as to get 5s, 7s, 8s, and 8s on the right-hand side and one of the six
+ * unique prefixes below on the left-hand side.  For instance, given the
+ * number 7236, we can split the digits it into primes and re-combine and
+ * get 479 which is the smallest number whose digets multiply to the same
+ * value as 7236.  Using this scheme, and reforming all numbers as
+ * <prefix>555777888999 where the number of 5s, 7s, 8s, and 8s varies, we
+ * can get all unique products of digits with the smallest possible number.
+ * This also gives us a very nice way to generate them.  I cannot take
+ * credit for this; it was Matt Parker's idea:
+ * https://www.youtube.com/watch?v=Wim9WJeDTHQ
+ *
+ * When we do this reduction, we are left with six unique prefixes that can
+ * end up at the front of the 7s, 8s, and 9s which I have in the list below
+ * sorted smallest to largest.  Even though 26 looks like the largest, the
+ * next 2-digit number will be a 2 followed by something that's at least a
+ * 7 so it really does make sense.
+ */
+#define NUM_PREFIXES 6
+static struct prefix prefixes[NUM_PREFIXES] = {
+    { "26", 2,  12  },
+    { "2",  1,  2   },
+    { "3",  1,  3   },
+    { "4",  1,  4   },
+    { "6",  1,  6   },
+    { "",   0,  1   },
+};
+
+struct candidate {
+    const struct prefix *prefix;
+    unsigned num5s;
+    unsigned num7s;
+    unsigned num8s;
+    unsigned num9s;
+};
+
+static unsigned
+candidate_digits(const struct candidate *cand)
+{
+    return cand->prefix->digits +
+           cand->num5s + cand->num7s + cand->num8s + cand->num9s;
+}
+
+struct digit_run {
+    char digit;
+    unsigned len;
+};
+
+#define MAX_CANDIDATE_RUNS 6
+
+static unsigned
+candidate_runs(const struct candidate *cand,
+               struct digit_run runs[MAX_CANDIDATE_RUNS])
+{
+    unsigned num_runs = 0;
+    for (const char *c = cand->prefix->str; *c; c++)
+        runs[num_runs++] = (struct digit_run) { *c, 1 };
+
+    const struct digit_run tail[] = {
+        { '5', cand->num5s },
+        { '7', cand->num7s },
+        { '8', cand->num8s },
+        { '9', cand->num9s },
+    };
+    for (unsigned i = 0; i < 4; i++) {
+        if (tail[i].len)
+            runs[num_runs++] = tail[i];
+    }
+
+    assert(num_runs <= MAX_CANDIDATE_RUNS);
+    return num_runs;
+}
+
+/* Compares two candidates by numeric value */
+static int
+candidate_cmp(const struct candidate *a, const struct candidate *b)
+{
+    unsigned a_digits = candidate_digits(a), b_digits = candidate_digits(b);
+    if (a_digits != b_digits)
+        return a_digits < b_digits ? -1 : 1;
+
+    /* Same length so it's a lexicographic compare which we can do a run of
+     * digits at a time.
+     */
+    struct digit_run a_runs[MAX_CANDIDATE_RUNS], b_runs[MAX_CANDIDATE_RUNS];
+    unsigned a_num_runs = candidate_runs(a, a_runs);
+    unsigned b_num_runs = candidate_runs(b, b_runs);
+
+    unsigned ai = 0, bi = 0;
+    while (ai < a_num_runs && bi < b_num_runs) {
+        if (a_runs[ai].digit != b_runs[bi].digit)
+            return a_runs[ai].digit < b_runs[bi].digit ? -1 : 1;
+
+        unsigned len = MIN2(a_runs[ai].len, b_runs[bi].len);
+        if ((a_runs[ai].len -= len) == 0)
+            ai++;
+        if ((b_runs[bi].len -= len) == 0)
+            bi++;
+    }
+
+    return 0;
+}
+
+#ifndef PERSISTENCE_LIBRARY
+/* Orders candidates by number of digits, then prefix, then the counts of
+ * 5s, 7s, 8s and 9s.  It's a total order so sorting by it doesn't depend on
+ * the order things were found in.
+ */
+static int
+candidate_order_cmp(const struct candidate *a, const struct candidate *b)
+{
+    unsigned a_digits = candidate_digits(a), b_digits = candidate_digits(b);
+    if (a_digits != b_digits)
+        return a_digits < b_digits ? -1 : 1;
+
+    int r = strcmp(a->prefix->str, b->prefix->str);
+    if (r)
+        return r;
+
+    const unsigned a_counts[] = { a->num5s, a->num7s, a->num8s, a->num9s };
+    const unsigned b_counts[] = { b->num5s, b->num7s, b->num8s, b->num9s };
+    for (unsigned i = 0; i < 4; i++) {
+        if (a_counts[i] != b_counts[i])
+            return a_counts[i] < b_counts[i] ? -1 : 1;
+    }
+
+    return 0;
+}
+#endif
+
+/* Factors the product of the digits of cand */
+static void
+candidate_exps(const struct candidate *cand, unsigned exps[NUM_PRIMES])
+{
+    exps[PRIME_2] = cand->num8s * 3;
+    exps[PRIME_3] = cand->num9s * 2;
+    exps[PRIME_5] = cand->num5s;
+    exps[PRIME_7] = cand->num7s;
+
+    /* Prefixes only have 2s and 3s */
+    unsigned prod = cand->prefix->prod;
+    for (; prod % 2 == 0; prod /= 2)
+        exps[PRIME_2]++;
+    for (; prod % 3 == 0; prod /= 3)
+        exps[PRIME_3]++;
+    assert(prod == 1);
+}
+
+/* Sets out to the product of the digits of cand */
+static void
+candidate_product(mpz_t out, const struct candidate *cand,
+                  struct workspace *ws)
+{
+    unsigned exps[NUM_PRIMES];
+    candidate_exps(cand, exps);
+    exps_to_mpz(out, exps, ws);
+}
+
+static void
+candidate_to_number(const struct candidate *cand,
+                    struct persistence_number *num)
+{
+    memset(num, 0, sizeof(*num));
+    num->base = 10;
+    num->digits = candidate_digits(cand);
+    for (const char *c = cand->prefix->str; *c; c++)
+        num->count[*c - '0']++;
+    num->count[5] = cand->num5s;
+    num->count[7] = cand->num7s;
+    num->count[8] = cand->num8s;
+    num->count[9] = cand->num9s;
+}
+
+struct candidate_list {
+    struct candidate *cands;
+    size_t len;
+    size_t cap;
+};
+
+static void
+candidate_list_append(struct candidate_list *list,
+                      const struct candidate *cand)
+{
+    if (list->len == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 64;
+        list->cands = realloc(list->cands, list->cap * sizeof(*list->cands));
+    }
+    list->cands[list->len++] = *cand;
+}
+
+/* Candidates held back with --deterministic to be sorted and printed at
+ * the end
+ */
+struct found_cand {
+    struct candidate cand;
+    unsigned persistence;
+};
+
+struct found_list {
+    struct found_cand *items;
+    size_t len;
+    size_t cap;
+};
+
+static void
+found_list_append(struct found_list *list, unsigned persistence,
+                  const struct candidate *cand)
+{
+    if (list->len == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 64;
+        list->items = realloc(list->items, list->cap * sizeof(*list->items));
+    }
+    list->items[list->len++] = (struct found_cand) {
+        .cand = *cand,
+        .persistence = persistence,
+    };
+}
+
+#ifndef PERSISTENCE_LIBRARY
+static int
+found_cand_cmp(const void *_a, const void *_b)
+{
+    const struct found_cand *a = _a, *b = _b;
+    return candidate_order_cmp(&a->cand, &b->cand);
+}
+#endif
+
+/** Output
+ *
+ * Candidates are printed as their prefix followed by the length of each
+ * run of digits after it, so 277777788888899 comes out as 2 7^6 8^6 9^2.
+ * At thousands of digits the expansion is mostly noise; --expand prints
+ * every digit instead.  With --format=jsonl, every line is a JSON object
+ * with the counts of each digit broken out.
+ *
+ * Output is built up in memory and written with a single fwrite() so
+ * threads streaming candidates with --all never interleave within a line
+ * and don't go through stdio for every digit.
+ */
+enum output_format {
+    OUTPUT_TEXT,
+    OUTPUT_JSONL,
+};
+
+struct output_options {
+    enum output_format format;
+    /* Print every digit rather than the runs */
+    bool expand;
+    /* Print every candidate of at least --min-persistence as it's found */
+    bool all;
+};
+
+/* Threads flush their --all output once they have this much */
+#define OUTPUT_FLUSH_BYTES (64 * 1024)
+
+struct out_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+static void
+out_buf_reserve(struct out_buf *buf, size_t size)
+{
+    if (buf->len + size <= buf->cap)
+        return;
+
+    buf->cap = MAX2(buf->cap * 2, buf->len + size);
+    buf->data = realloc(buf->data, buf->cap);
+}
+
+static void __attribute__((format(printf, 2, 3)))
+out_buf_printf(struct out_buf *buf, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    /* One more for the NUL */
+    out_buf_reserve(buf, len + 1);
+    va_start(args, fmt);
+    vsnprintf(buf->data + buf->len, len + 1, fmt, args);
+    va_end(args);
+    buf->len += len;
+}
+
+static void
+out_buf_fill(struct out_buf *buf, char c, size_t count)
+{
+    out_buf_reserve(buf, count);
+    memset(buf->data + buf->len, c, count);
+    buf->len += count;
+}
+
+#ifndef PERSISTENCE_LIBRARY
+static void
+out_buf_mpz(struct out_buf *buf, const mpz_t z)
+{
+    /* mpz_sizeinbase() may be one too big and mpz_get_str() wants room for
+     * a sign and the NUL
+     */
+    out_buf_reserve(buf, mpz_sizeinbase(z, 10) + 2);
+    mpz_get_str(buf->data + buf->len, 10, z);
+    buf->len += strlen(buf->data + buf->len);
+}
+#endif
+
+static void
+out_buf_flush(struct out_buf *buf, FILE *f)
+{
+    if (buf->len) {
+        fwrite(buf->data, 1, buf->len, f);
+        fflush(f);
+    }
+    buf->len = 0;
+}
+
+static void
+out_buf_finish(struct out_buf *buf)
+{
+    free(buf->data);
+    *buf = (struct out_buf) { NULL, };
+}
+
+static void
+out_candidate_digits(struct out_buf *buf, const struct candidate *cand)
+{
+    out_buf_printf(buf, "%s", cand->prefix->str);
+    out_buf_fill(buf, '5', cand->num5s);
+    out_buf_fill(buf, '7', cand->num7s);
+    out_buf_fill(buf, '8', cand->num8s);
+    out_buf_fill(buf, '9', cand->num9s);
+}
+
+static void
+out_candidate(struct out_buf *buf, const struct output_options *opts,
+              const struct candidate *cand)
+{
+    if (opts->format == OUTPUT_JSONL) {
+        out_buf_printf(buf, "\"digits\": %u, \"prefix\": \"%s\", "
+                       "\"runs\": { \"5\": %u, \"7\": %u, \"8\": %u, "
+                       "\"9\": %u }", candidate_digits(cand),
+                       cand->prefix->str, cand->num5s, cand->num7s,
+                       cand->num8s, cand->num9s);
+        if (opts->expand) {
+            out_buf_printf(buf, ", \"number\": \"");
+            out_candidate_digits(buf, cand);
+            out_buf_printf(buf, "\"");
+        }
+        return;
+    }
+
+    if (opts->expand) {
+        out_candidate_digits(buf, cand);
+        return;
+    }
+
+    out_buf_printf(buf, "%s", cand->prefix->str);
+    const struct digit_run tail[] = {
+        { '5', cand->num5s },
+        { '7', cand->num7s },
+        { '8', cand->num8s },
+        { '9', cand->num9s },
+    };
+    bool first = cand->prefix->digits == 0;
+    for (unsigned i = 0; i < 4; i++) {
+        if (tail[i].len == 0)
+            continue;
+
+        out_buf_printf(buf, "%s%c^%u", first ? "" : " ", tail[i].digit,
+                       tail[i].len);
+        first = false;
+    }
+}
+
+/* Writes a line for a candidate with the given persistence.  type says
+ * what it is in JSON.
+ */
+static void
+out_candidate_line(struct out_buf *buf, const struct output_options *opts,
+                   const char *type, unsigned persistence,
+                   const struct candidate *cand)
+{
+    if (opts->format == OUTPUT_JSONL) {
+        out_buf_printf(buf, "{ \"type\": \"%s\", \"persistence\": %u, ",
+                       type, persistence);
+        out_candidate(buf, opts, cand);
+        out_buf_printf(buf, " }\n");
+    } else {
+        out_buf_printf(buf, "%02u:  ", persistence);
+        out_candidate(buf, opts, cand);
+        out_buf_printf(buf, "\n");
+    }
+}
+
+/** Walks the candidates for one prefix and number of digits
+ *
+ * The candidates are split into rows.  If the prefix product is odd, the
+ * first num579s rows are the numbers which contain at least one 5 (and
+ * therefore no 8s) with row r having r 7s and 9s.  After that come the
+ * numbers with only 7s, 8s, and 9s with row r having r 8s and 9s.  Within a
+ * row, each candidate has one more 9 than the one before it.
+ *
+ * Neighbouring candidates differ by a single factor so, instead of
+ * computing each product of digits from scratch, we walk the rows and get
+ * the next one by multiplying by 9/7 or 9/8 within a row and 7/5 or 8/7
+ * from one row to the next.  Exact division by a small constant is linear
+ * in the size of the number so each step is O(n) rather than the M(n)
+ * needed for the powers.  The enumeration order is the same as that of
+ * the obvious nested loops.
+ */
+struct candidate_iter {
+    struct candidate cand;
+
+    /* Number of 5s, 7s, 8s, and 9s */
+    unsigned tail_digits;
+    /* Number of rows which contain 5s */
+    unsigned five_rows;
+
+    unsigned row;
+    unsigned end_row;
+    bool row_valid;
+
+    /* Product of the digits of the first candidate in the current row */
+    mpz_t row_num;
+    /* Product of the digits of cand */
+    mpz_t num;
+    mpz_t pow;
+};
+
+static void
+candidate_iter_init(struct candidate_iter *it, unsigned max_digits)
+{
+    const mp_bitcnt_t bits = digits_max_bits(max_digits);
+    mpz_init2(it->row_num, bits);
+    mpz_init2(it->num, bits);
+    mpz_init2(it->pow, bits);
+}
+
+static void
+candidate_iter_finish(struct candidate_iter *it)
+{
+    mpz_clear(it->row_num);
+    mpz_clear(it->num);
+    mpz_clear(it->pow);
+}
+
+static unsigned
+candidate_num_rows(const struct prefix *prefix, unsigned digits)
+{
+    assert(digits >= prefix->digits);
+    unsigned tail_digits = digits - prefix->digits;
+    unsigned five_rows = (prefix->prod & 1) ? tail_digits : 0;
+    return five_rows + tail_digits + 1;
+}
+
+/* Sets up the iterator to walk rows [row_begin, row_end).  The first call
+ * to candidate_iter_next() returns the first candidate.
+ */
+static void
+candidate_iter_start(struct candidate_iter *it, const struct prefix *prefix,
+                     unsigned digits, unsigned row_begin, unsigned row_end)
+{
+    assert(row_end <= candidate_num_rows(prefix, digits));
+
+    it->cand.prefix = prefix;
+    it->tail_digits = digits - prefix->digits;
+    it->five_rows = (prefix->prod & 1) ? it->tail_digits : 0;
+    it->row = row_begin;
+    it->end_row = row_end;
+    it->row_valid = false;
+}
+
+/* Sets the digits of cand to those of the first candidate of the given
+ * row and returns the number of candidates in the row.  The prefix is left
+ * alone.
+ */
+static unsigned
+candidate_row_start(struct candidate *cand, unsigned tail_digits,
+                    unsigned five_rows, unsigned row)
+{
+    cand->num9s = 0;
+    if (row < five_rows) {
+        cand->num5s = tail_digits - row;
+        cand->num7s = row;
+        cand->num8s = 0;
+        return cand->num7s + 1;
+    } else {
+        cand->num5s = 0;
+        cand->num7s = tail_digits - (row - five_rows);
+        cand->num8s = row - five_rows;
+        return cand->num8s + 1;
+    }
+}
+
+/* Computes the first candidate of the current row from scratch */
+static void
+candidate_iter_seek_row(struct candidate_iter *it)
+{
+    struct candidate *cand = &it->cand;
+
+    candidate_row_start(cand, it->tail_digits, it->five_rows, it->row);
+
+    /* num gets overwritten with row_num by our caller so we can use it as
+     * scratch space.
+     */
+    mpz_srcptr pow7 = power_get(PRIME_7, cand->num7s, it->pow);
+    if (cand->num5s) {
+        mpz_mul(it->row_num, power_get(PRIME_5, cand->num5s, it->num), pow7);
+    } else {
+        mpz_mul_2exp(it->row_num, pow7, cand->num8s * 3);
+    }
+    mpz_mul_ui(it->row_num, it->row_num, cand->prefix->prod);
+}
+
+static bool
+candidate_iter_next(struct candidate_iter *it)
+{
+    struct candidate *cand = &it->cand;
+
+    if (it->row_valid) {
+        if (it->row < it->five_rows && cand->num7s > 0) {
+            /* Trade a 7 for a 9 */
+            mpz_divexact_ui(it->num, it->num, 7);
+            mpz_mul_ui(it->num, it->num, 9);
+            cand->num7s--;
+            cand->num9s++;
+            return true;
+        } else if (it->row >= it->five_rows && cand->num8s > 0) {
+            /* Trade an 8 for a 9 */
+            mpz_tdiv_q_2exp(it->num, it->num, 3);
+            mpz_mul_ui(it->num, it->num, 9);
+            cand->num8s--;
+            cand->num9s++;
+            return true;
+        }
+
+        /* Move on to the next row */
+        it->row++;
+        if (it->row >= it->end_row)
+            return false;
+
+        cand->num9s = 0;
+        if (it->row < it->five_rows) {
+            /* Trade a 5 for a 7 */
+            mpz_divexact_ui(it->row_num, it->row_num, 5);
+            mpz_mul_ui(it->row_num, it->row_num, 7);
+            cand->num5s--;
+            cand->num7s = it->row;
+        } else if (it->row > it->five_rows) {
+            /* Trade a 7 for an 8 */
+            mpz_divexact_ui(it->row_num, it->row_num, 7);
+            mpz_mul_2exp(it->row_num, it->row_num, 3);
+            cand->num7s = it->tail_digits - (it->row - it->five_rows);
+            cand->num8s = it->row - it->five_rows;
+        } else {
+            /* First row without 5s */
+            candidate_iter_seek_row(it);
+        }
+    } else {
+        if (it->row >= it->end_row)
+            return false;
+
+        candidate_iter_seek_row(it);
+        it->row_valid = true;
+    }
+
+    mpz_set(it->num, it->row_num);
+    return true;
+}
+
+/** Results of a search
+ *
+ * For each persistence, we keep the number of candidates which have it and
+ * the smallest one.  Each thread gets its own copy which it can update
+ * without any locking and they get merged once at the end.  Since the
+ * smallest witness doesn't depend on the order in which we find things,
+ * neither does the output.
+ */
+#define MAX_PERSISTENCE PERSISTENCE_MAX
+
+struct persistence_results {
+    uint64_t count[MAX_PERSISTENCE];
+    struct candidate witness[MAX_PERSISTENCE];
+    /* Candidates known to be below --min-persistence with --prune */
+    uint64_t pruned;
+} __attribute__((aligned(64)));
+
+static void
+results_add(struct persistence_results *results, unsigned persistence,
+            uint64_t count, const struct candidate *cand)
+{
+    assert(persistence < MAX_PERSISTENCE);
+    if (results->count[persistence] == 0 ||
+        candidate_cmp(cand, &results->witness[persistence]) < 0)
+        results->witness[persistence] = *cand;
+    results->count[persistence] += count;
+}
+
+static void
+results_merge(struct persistence_results *dst,
+              const struct persistence_results *src)
+{
+    for (unsigned p = 0; p < MAX_PERSISTENCE; p++) {
+        if (src->count[p])
+            results_add(dst, p, src->count[p], &src->witness[p]);
+    }
+    dst->pruned += src->pruned;
+}
+
+#ifndef PERSISTENCE_LIBRARY
+static void
+results_print(const struct persistence_results *results,
+              unsigned min_persistence, const struct output_options *opts)
+{
+    const bool json = opts->format == OUTPUT_JSONL;
+    struct out_buf buf = { NULL, };
+
+    for (unsigned p = min_persistence; p < MAX_PERSISTENCE; p++) {
+        if (results->count[p])
+            out_candidate_line(&buf, opts, "record", p, &results->witness[p]);
+    }
+
+    if (!json)
+        out_buf_printf(&buf, "\nCandidates by persistence:\n");
+    for (unsigned p = 0; p < MAX_PERSISTENCE; p++) {
+        if (results->count[p] == 0)
+            continue;
+
+        if (json) {
+            out_buf_printf(&buf, "{ \"type\": \"count\", \"persistence\": "
+                           "%u, \"count\": %" PRIu64 " }\n", p,
+                           results->count[p]);
+        } else {
+            out_buf_printf(&buf, "%02u:  %" PRIu64 "\n", p, results->count[p]);
+        }
+    }
+
+    if (results->pruned) {
+        if (json) {
+            out_buf_printf(&buf, "{ \"type\": \"pruned\", \"below\": %u, "
+                           "\"count\": %" PRIu64 " }\n", min_persistence,
+                           results->pruned);
+        } else {
+            out_buf_printf(&buf, "\nPruned below %02u:  %" PRIu64 "\n",
+                           min_persistence, results->pruned);
+        }
+    }
+
+    out_buf_flush(&buf, stdout);
+    out_buf_finish(&buf);
+}
+#endif
+
+/** Census of every number
+ *
+ * With --census we also count how many numbers of each length there are
+ * with each persistence, not just how many candidates.  A number of two or
+ * more digits without a 0 has the same persistence as the candidate with
+ * the same product of digits, so each candidate stands for every way of
+ * writing its product with d digits, for each d from its own length up.
+ * Those are counted rather than walked.  The 5s and 7s can only be 5s and
+ * 7s and go anywhere, which is a multinomial, and the ways of making the
+ * 2s and 3s out of the rest of the digits come from a table built up one
+ * digit at a time.
+ *
+ * The numbers the search never sees are counted directly.  Anything with a
+ * 0 has persistence 1.  Anything else with both a 5 and an even digit has
+ * persistence 2 because its product ends in 0.  Single digits take no
+ * steps at all.  Between them and the candidates, every one of the
+ * 9 * 10^(d - 1) numbers of d digits has to be counted exactly once and
+ * we check that it is.
+ *
+ * The tables grow with the cube of the number of digits and each candidate
+ * adds to every length above its own, so this is for hundreds of digits,
+ * not thousands.
+ */
+static struct census_tables {
+    unsigned max_digits;
+    /* binomial(n, k) is binom[n * (n + 1) / 2 + k] */
+    mpz_t *binom;
+    /* The number of ways to write 2^a 3^b as m digits, each of them 1, 2,
+     * 3, 4, 6, 8 or 9, is smooth[m][a * (2 * m + 1) + b].
+     */
+    mpz_t **smooth;
+} census_tables;
+
+struct census {
+    /* Numbers of d digits with persistence p at d * MAX_PERSISTENCE + p */
+    mpz_t *count;
+    mpz_t tmp;
+};
+
+static inline mpz_srcptr
+census_binom(unsigned n, unsigned k)
+{
+    return census_tables.binom[(size_t)n * (n + 1) / 2 + k];
+}
+
+static inline mpz_srcptr
+census_smooth(unsigned m, unsigned a, unsigned b)
+{
+    return census_tables.smooth[m][(size_t)a * (2 * m + 1) + b];
+}
+
+#ifndef PERSISTENCE_LIBRARY
+static void
+census_tables_init(unsigned max_digits)
+{
+    struct census_tables *t = &census_tables;
+    t->max_digits = max_digits;
+
+    t->binom = malloc((size_t)(max_digits + 1) * (max_digits + 2) / 2 *
+                      sizeof(*t->binom));
+    for (unsigned n = 0; n <= max_digits; n++) {
+        mpz_t *row = &t->binom[(size_t)n * (n + 1) / 2];
+        const mpz_t *prev = &t->binom[(size_t)(n - 1) * n / 2];
+        for (unsigned k = 0; k <= n; k++) {
+            mpz_init(row[k]);
+            if (k == 0 || k == n)
+                mpz_set_ui(row[k], 1);
+            else
+                mpz_add(row[k], prev[k - 1], prev[k]);
+        }
+    }
+
+    /* Exponents of 2 and 3 in each digit which has no other factors */
+    static const unsigned factors[][2] = {
+        { 0, 0 }, { 1, 0 }, { 0, 1 }, { 2, 0 }, { 1, 1 }, { 3, 0 }, { 0, 2 },
+    };
+    const unsigned num_factors = sizeof(factors) / sizeof(factors[0]);
+
+    t->smooth = malloc((max_digits + 1) * sizeof(*t->smooth));
+    for (unsigned m = 0; m <= max_digits; m++) {
+        t->smooth[m] = malloc((size_t)(3 * m + 1) * (2 * m + 1) *
+                              sizeof(*t->smooth[m]));
+        for (unsigned a = 0; a <= 3 * m; a++) {
+            for (unsigned b = 0; b <= 2 * m; b++) {
+                mpz_ptr z = t->smooth[m][(size_t)a * (2 * m + 1) + b];
+                mpz_init(z);
+                if (m == 0) {
+                    mpz_set_ui(z, 1);
+                    continue;
+                }
+
+                /* Sum over the last digit */
+                for (unsigned i = 0; i < num_factors; i++) {
+                    if (a < factors[i][0] || b < factors[i][1])
+                        continue;
+                    const unsigned pa = a - factors[i][0];
+                    const unsigned pb = b - factors[i][1];
+                    if (pa <= 3 * (m - 1) && pb <= 2 * (m - 1))
+                        mpz_add(z, z, census_smooth(m - 1, pa, pb));
+                }
+            }
+        }
+    }
+}
+
+static void
+census_tables_finish(void)
+{
+    struct census_tables *t = &census_tables;
+    if (!t->binom)
+        return;
+
+    for (size_t i = 0; i < (size_t)(t->max_digits + 1) *
+                            (t->max_digits + 2) / 2; i++)
+        mpz_clear(t->binom[i]);
+    free(t->binom);
+
+    for (unsigned m = 0; m <= t->max_digits; m++) {
+        for (size_t i = 0; i < (size_t)(3 * m + 1) * (2 * m + 1); i++)
+            mpz_clear(t->smooth[m][i]);
+        free(t->smooth[m]);
+    }
+    free(t->smooth);
+
+    *t = (struct census_tables) { 0, };
+}
+
+static size_t
+census_num_counts(void)
+{
+    return (size_t)(census_tables.max_digits + 1) * MAX_PERSISTENCE;
+}
+
+static void
+census_init(struct census *census)
+{
+    census->count = malloc(census_num_counts() * sizeof(*census->count));
+    for (size_t i = 0; i < census_num_counts(); i++)
+        mpz_init(census->count[i]);
+    mpz_init(census->tmp);
+}
+
+static void
+census_finish(struct census *census)
+{
+    if (!census->count)
+        return;
+
+    for (size_t i = 0; i < census_num_counts(); i++)
+        mpz_clear(census->count[i]);
+    free(census->count);
+    mpz_clear(census->tmp);
+    census->count = NULL;
+}
+#endif
+
+static inline mpz_ptr
+census_count(struct census *census, unsigned digits, unsigned persistence)
+{
+    assert(persistence < MAX_PERSISTENCE);
+    return census->count[(size_t)digits * MAX_PERSISTENCE + persistence];
+}
+
+/* Counts every number of two or more digits which has the same product of
+ * digits as cand
+ */
+static void
+census_add(struct census *census, const struct candidate *cand,
+           unsigned persistence)
+{
+    unsigned exps[NUM_PRIMES];
+    candidate_exps(cand, exps);
+    const unsigned num5s = exps[PRIME_5], num7s = exps[PRIME_7];
+
+    for (unsigned d = MAX2(candidate_digits(cand), 2);
+         d <= census_tables.max_digits; d++) {
+        mpz_mul(census->tmp, census_binom(d, num5s),
+                census_binom(d - num5s, num7s));
+        mpz_addmul(census_count(census, d, persistence), census->tmp,
+                   census_smooth(d - num5s - num7s, exps[PRIME_2],
+                                 exps[PRIME_3]));
+    }
+}
+
+#ifndef PERSISTENCE_LIBRARY
+/* Counts all the numbers the search doesn't see */
+static void
+census_add_unsearched(struct census *census)
+{
+    /* Candidates of fewer than two digits.  Their products are single
+     * digits so the numbers they stand for all have persistence 1.
+     */
+    for (unsigned digits = 0; digits < 2; digits++) {
+        for (unsigned p = 0; p < NUM_PREFIXES; p++) {
+            if (digits < prefixes[p].digits)
+                continue;
+
+            struct candidate cand = { .prefix = &prefixes[p] };
+            const unsigned tail_digits = digits - prefixes[p].digits;
+            const unsigned five_rows =
+                (prefixes[p].prod & 1) ? tail_digits : 0;
+            const unsigned num_rows = candidate_num_rows(&prefixes[p], digits);
+            for (unsigned row = 0; row < num_rows; row++) {
+                unsigned len = candidate_row_start(&cand, tail_digits,
+                                                   five_rows, row);
+                for (unsigned i = 0; i < len; i++) {
+                    census_add(census, &cand, 1);
+                    if (cand.num5s)
+                        cand.num7s--;
+                    else
+                        cand.num8s--;
+                    cand.num9s++;
+                }
+            }
+        }
+    }
+
+    mpz_add_ui(census_count(census, 1, 0), census_count(census, 1, 0), 9);
+
+    mpz_t a, b;
+    mpz_inits(a, b, NULL);
+    for (unsigned d = 2; d <= census_tables.max_digits; d++) {
+        /* 9 * 10^(d - 1) - 9^d with a 0 */
+        mpz_ui_pow_ui(a, 10, d - 1);
+        mpz_mul_ui(a, a, 9);
+        mpz_ui_pow_ui(b, 9, d);
+        mpz_sub(a, a, b);
+        mpz_add(census_count(census, d, 1), census_count(census, d, 1), a);
+
+        /* 9^d - 8^d - 5^d + 4^d with no 0 but a 5 and an even digit */
+        mpz_set(a, b);
+        mpz_ui_pow_ui(b, 8, d);
+        mpz_sub(a, a, b);
+        mpz_ui_pow_ui(b, 5, d);
+        mpz_sub(a, a, b);
+        mpz_ui_pow_ui(b, 4, d);
+        mpz_add(a, a, b);
+        mpz_add(census_count(census, d, 2), census_count(census, d, 2), a);
+    }
+    mpz_clears(a, b, NULL);
+}
+
+static void
+census_merge(struct census *dst, struct census *src)
+{
+    for (size_t i = 0; i < census_num_counts(); i++)
+        mpz_add(dst->count[i], dst->count[i], src->count[i]);
+}
+
+/* Checks that every number of each length was counted exactly once */
+static bool
+census_check(struct census *census)
+{
+    mpz_t total, expected;
+    mpz_inits(total, expected, NULL);
+
+    bool ok = true;
+    for (unsigned d = 1; d <= census_tables.max_digits; d++) {
+        mpz_set_ui(total, 0);
+        for (unsigned p = 0; p < MAX_PERSISTENCE; p++)
+            mpz_add(total, total, census_count(census, d, p));
+
+        mpz_ui_pow_ui(expected, 10, d - 1);
+        mpz_mul_ui(expected, expected, 9);
+        if (mpz_cmp(total, expected) != 0) {
+            gmp_fprintf(stderr, "Census of %u digits adds up to %Zd, not "
+                        "%Zd\n", d, total, expected);
+            ok = false;
+        }
+    }
+
+    mpz_clears(total, expected, NULL);
+    return ok;
+}
+
+static void
+census_print(struct census *census, const struct output_options *opts)
+{
+    const bool json = opts->format == OUTPUT_JSONL;
+    struct out_buf buf = { NULL, };
+
+    for (unsigned d = 1; d <= census_tables.max_digits; d++) {
+        if (!json)
+            out_buf_printf(&buf, "\nNumbers of %u digits by persistence:\n", d);
+        for (unsigned p = 0; p < MAX_PERSISTENCE; p++) {
+            mpz_ptr count = census_count(census, d, p);
+            if (mpz_sgn(count) == 0)
+                continue;
+
+            if (json) {
+                out_buf_printf(&buf, "{ \"type\": \"census\", \"digits\": "
+                               "%u, \"persistence\": %u, \"count\": ", d, p);
+                out_buf_mpz(&buf, count);
+                out_buf_printf(&buf, " }\n");
+            } else {
+                out_buf_printf(&buf, "%02u:  ", p);
+                out_buf_mpz(&buf, count);
+                out_buf_printf(&buf, "\n");
+            }
+        }
+    }
+
+    out_buf_flush(&buf, stdout);
+    out_buf_finish(&buf);
+}
+#endif
+
+static unsigned
+thread_index(void)
+{
+#ifdef USE_OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+static unsigned
+max_threads(void)
+{
+#ifdef USE_OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+/** Search over the exponent space of the second step
+ *
+ * The prefix scheme above means every candidate has a different product of
+ * digits, but lots of those products in turn have the same product of
+ * digits 2^a * 3^b * 5^c * 7^d.  Instead of running the persistence of
+ * every candidate to completion, we take one step, collect the exponent
+ * vectors of the survivors, deduplicate them, and compute the persistence
+ * once per unique vector.  Each vector keeps the number of candidates
+ * which produce it and the smallest of them.
+ */
+struct exps_hit {
+    unsigned exps[NUM_PRIMES];
+    struct candidate cand;
+    uint64_t count;
+};
+
+struct exps_hit_list {
+    struct exps_hit *hits;
+    size_t len;
+    size_t cap;
+};
+
+static void
+exps_hit_list_append(struct exps_hit_list *list, const struct exps_hit *hit)
+{
+    if (list->len == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 64;
+        list->hits = realloc(list->hits, list->cap * sizeof(*list->hits));
+    }
+    list->hits[list->len++] = *hit;
+}
+
+static void
+exps_hit_list_append_list(struct exps_hit_list *list,
+                          const struct exps_hit_list *other)
+{
+    for (size_t i = 0; i < other->len; i++)
+        exps_hit_list_append(list, &other->hits[i]);
+}
+
+#ifndef PERSISTENCE_LIBRARY
+static int
+exps_hit_cmp(const void *_a, const void *_b)
+{
+    const struct exps_hit *a = _a, *b = _b;
+    for (unsigned i = 0; i < NUM_PRIMES; i++) {
+        if (a->exps[i] != b->exps[i])
+            return a->exps[i] < b->exps[i] ? -1 : 1;
+    }
+    return candidate_cmp(&a->cand, &b->cand);
+}
+
+/* Deduplicates the list by exponent vector, computes the persistence of
+ * each unique vector, and adds it to the results.
+ */
+static void
+exponent_search_finish(struct exps_hit_list *list, unsigned max_digits,
+                       struct persistence_results *results,
+                       struct persistence_stats *stats)
+{
+    qsort(list->hits, list->len, sizeof(*list->hits), exps_hit_cmp);
+
+    /* The list is sorted so the first of each run is the smallest */
+    size_t num_unique = 0;
+    for (size_t i = 0; i < list->len; i++) {
+        if (num_unique > 0 &&
+            memcmp(list->hits[num_unique - 1].exps, list->hits[i].exps,
+                   sizeof(list->hits[i].exps)) == 0) {
+            list->hits[num_unique - 1].count += list->hits[i].count;
+            continue;
+        }
+        list->hits[num_unique++] = list->hits[i];
+    }
+
+    fprintf(stderr, "Exponent search: %zu second-step products, %zu unique\n",
+            list->len, num_unique);
+
+    unsigned *persistence = malloc(num_unique * sizeof(*persistence));
+
+#ifdef USE_OPENMP
+    #pragma omp parallel
+#endif
+    {
+        numa_bind_thread(thread_index());
+        struct workspace ws;
+        workspace_init(&ws, max_digits);
+        mpz_t num;
+        mpz_init2(num, digits_max_bits(max_digits));
+
+#ifdef USE_OPENMP
+        #pragma omp for schedule(dynamic)
+#endif
+        for (size_t i = 0; i < num_unique; i++) {
+            /* One step for the candidate to its first product and one more
+             * to the product we're looking at.
+             */
+            bool zero;
+            persistence[i] = 2 + exps_persistence(num, list->hits[i].exps,
+                                                  &ws, &zero);
+            if (dead_set.bits)
+                dead_set_record(list->hits[i].exps, persistence[i] - 2);
+            if (zero) {
+                ws.stats.zero_exits[MIN2(persistence[i],
+                                         STATS_MAX_STEP - 1)] +=
+                    list->hits[i].count;
+            }
+        }
+
+        mpz_clear(num);
+        persistence_stats_add(stats, &ws.stats);
+        workspace_finish(&ws);
+    }
+
+    for (size_t i = 0; i < num_unique; i++) {
+        results_add(results, persistence[i], list->hits[i].count,
+                    &list->hits[i].cand);
+    }
+
+    free(persistence);
+}
+#endif
+
+struct search_config {
+    unsigned min_digits;
+    unsigned max_digits;
+    /* 0 means let OpenMP decide */
+    unsigned threads;
+    unsigned min_persistence;
+    /* 0 disables progress reporting */
+    unsigned progress_interval;
+    bool exponent_search;
+    /* NULL disables checkpointing */
+    const char *checkpoint_path;
+    /* Seconds between checkpoints */
+    unsigned checkpoint_interval;
+    bool resume;
+    /* Address to coordinate a distributed search on or NULL */
+    const char *serve_addr;
+    /* Coordinator to work for or NULL */
+    const char *connect_addr;
+    /* Seconds before a worker's lease is handed to someone else */
+    unsigned lease_timeout;
+    /* Memory cap for the tables of powers, in MiB */
+    unsigned power_table_mb;
+    /* Seconds between status reports; 0 disables them */
+    unsigned report_interval;
+    /* File to keep the latest status in or NULL */
+    const char *status_path;
+    /* Count candidates known to be below min_persistence as pruned */
+    bool prune;
+    /* File to load and save the dead set in or NULL */
+    const char *prune_path;
+    /* Memory cap for the dead set, in MiB */
+    unsigned prune_mb;
+    /* File of evaluated products to look up and add to or NULL */
+    const char *store_path;
+    enum numa_mode numa;
+    /* File to load tuned crossovers from, or write them to with
+     * --autotune, or NULL
+     */
+    const char *tuning_path;
+    struct output_options output;
+    /* Name of the rejection backend or NULL to pick one */
+    const char *reject_backend;
+    /* Count every number by digits and persistence */
+    bool census;
+    /* Pass survivors between threads through a queue */
+    bool pipeline;
+    /* Hold the --all output back and print it sorted at the end */
+    bool deterministic;
+    /* Check results against the naive product of digits, and one in
+     * verify_sample of the other candidates; 0 checks only the results
+     */
+    bool verify;
+    unsigned verify_sample;
+    unsigned base;
+    /* Called with every candidate of at least min_persistence or NULL */
+    persistence_found_fn found;
+    void *found_data;
+};
+
+/* The --min-persistence pruning is for or 0 */
+static unsigned
+search_config_prune_below(const struct search_config *config)
+{
+    return config->prune ? config->min_persistence : 0;
+}
+
+/** Units of work
+ *
+ * The amount of work for a given number of digits grows roughly cubically
+ * and the numbers get bigger too so splitting the search by number of
+ * digits alone leaves a long tail where a few threads grind through the
+ * biggest digit counts while the rest sit idle.  Instead, we split each
+ * number of digits into units of a few rows of one prefix each, sized to
+ * have roughly UNIT_CANDIDATES candidates in them.  The search walks units
+ * from the largest number of digits down so the expensive ones get started
+ * first and the cheap ones fill in the tail.
+ */
+#define UNIT_CANDIDATES 4096
+
+struct work_unit {
+    unsigned digits;
+    const struct prefix *prefix;
+    unsigned row_begin;
+    unsigned row_end;
+};
+
+static inline unsigned
+unit_rows(unsigned digits)
+{
+    /* Each row has at most digits + 1 candidates in it */
+    return (UNIT_CANDIDATES + digits) / (digits + 1);
+}
+
+static unsigned
+digits_num_units(unsigned digits)
+{
+    unsigned num_units = 0;
+    for (unsigned p = 0; p < NUM_PREFIXES; p++) {
+        if (digits < prefixes[p].digits)
+            continue;
+
+        unsigned num_rows = candidate_num_rows(&prefixes[p], digits);
+        num_units += DIV_ROUND_UP(num_rows, unit_rows(digits));
+    }
+    return num_units;
+}
+
+static void
+digits_get_unit(unsigned digits, unsigned index, struct work_unit *unit)
+{
+    const unsigned rows = unit_rows(digits);
+    for (unsigned p = 0; p < NUM_PREFIXES; p++) {
+        if (digits < prefixes[p].digits)
+            continue;
+
+        unsigned num_rows = candidate_num_rows(&prefixes[p], digits);
+        unsigned num_units = DIV_ROUND_UP(num_rows, rows);
+        if (index < num_units) {
+            unit->digits = digits;
+            unit->prefix = &prefixes[p];
+            unit->row_begin = index * rows;
+            unit->row_end = MIN2(unit->row_begin + rows, num_rows);
+            return;
+        }
+        index -= num_units;
+    }
+    assert(!"Unit index out of range");
+}
+
+/* Layout for reject_unit_batch() below */
+#define BATCH_LANES 16
+#define BATCH_MAX_LIMBS 80
+#define BATCH_LIMB_BASE 10000
+#define BATCH_SEGMENT 32
+/* Below this the first product can be a single digit */
+#define BATCH_MIN_DIGITS 8
+/* Longest candidates the lanes fit, one more 9 included */
+#define BATCH_MAX_DIGITS (BATCH_MAX_LIMBS * 4 - 2)
+
+/* Longer candidates go to the cpu backend; set by a tuning file */
+static unsigned batch_max_digits = BATCH_MAX_DIGITS;
+
+/* One limb of every lane */
+typedef uint32_t batch_vec __attribute__((vector_size(BATCH_LANES * 4)));
+
+struct batch_lanes {
+    batch_vec limbs[BATCH_MAX_LIMBS];
+    /* All ones if the next step divides by 7 rather than 8, 10^4 divided
+     * by the divisor and 2^16 / divisor rounded up
+     */
+    batch_vec is7;
+    batch_vec base_quot;
+    batch_vec magic;
+    batch_vec zero;
+    /* Current candidate of each lane and how many are left after it */
+    struct candidate cand[BATCH_LANES];
+    unsigned left[BATCH_LANES];
+} __attribute__((aligned(64)));
+
+/* Per-thread search state */
+struct search_thread {
+    struct candidate_iter iter;
+    struct workspace ws;
+    /* Copy of ws.stats as of the last finished unit for progress reports */
+    struct persistence_stats live_stats;
+    mpz_t num;
+    /* Survivors of the unit being searched, only used for exponent search */
+    struct exps_hit_list unit_hits;
+    /* Candidates found for --all which haven't been written yet */
+    struct out_buf out;
+    /* Same with --deterministic, where they're only sorted and written at
+     * the end
+     */
+    struct found_list found;
+    /* Candidates of the unit being searched which got past the rejection
+     * stage
+     */
+    struct candidate_list survivors;
+    struct batch_lanes batch;
+    /* Numbers counted by this thread with --census, NULL count otherwise */
+    struct census census;
+
+    /* Protects everything below against the checkpointer.  Nobody else
+     * ever takes it so it's never contended in the normal case.
+     */
+    pthread_mutex_t mtx;
+    /* Results of all the units this thread has finished */
+    struct persistence_results results;
+    struct exps_hit_list hits;
+    /* Units finished since the last checkpoint */
+    uint64_t *done_units;
+    size_t num_done_units;
+    size_t done_units_cap;
+} __attribute__((aligned(64)));
+
+struct search {
+    const struct search_config *config;
+
+    unsigned num_threads;
+    struct search_thread *threads;
+
+    /* Global index of the first unit for each number of digits, relative
+     * to config->min_digits.  There's one extra at the end.
+     */
+    uint64_t *unit_offsets;
+    uint64_t num_units;
+
+    /* Bitmap of units whose results are either in base_results and
+     * base_hits or have been handed to the checkpointer by a thread.
+     */
+    uint64_t *done;
+    /* Results loaded from a checkpoint or sent to us by workers */
+    struct persistence_results base_results;
+    struct exps_hit_list base_hits;
+
+    /* Units left in each progress bucket or NULL if progress reporting is
+     * disabled.
+     */
+    uint64_t *units_left;
+
+    /* Counters of threads which have finished */
+    struct persistence_stats stats;
+    /* Candidates of those threads by the NUMA node they ran on */
+    uint64_t node_candidates[NUMA_MAX_NODES];
+    /* Where the time went with --pipeline */
+    struct pipeline_stats {
+        uint64_t generate_ns;
+        uint64_t evaluate_ns;
+        uint64_t batches;
+        /* Batches evaluated by a thread other than the one which made
+         * them
+         */
+        uint64_t handed_over;
+    } pipeline;
+
+    /* Rough measure of the work in the whole search and how much is done,
+     * for estimating the time left.  The cost of a candidate is roughly
+     * linear in its number of digits so a unit counts for that many.
+     */
+    uint64_t work_total;
+    uint64_t work_done;
+    /* Work done when we started, i.e. loaded from a checkpoint */
+    uint64_t work_start;
+    uint64_t start_ns;
+
+    pthread_mutex_t checkpoint_mtx;
+    uint64_t next_checkpoint_ns;
+
+    pthread_mutex_t report_mtx;
+    uint64_t next_report_ns;
+};
+
+static inline bool
+unit_is_done(const struct search *search, uint64_t index)
+{
+    uint64_t word = __atomic_load_n(&search->done[index / 64],
+                                    __ATOMIC_RELAXED);
+    return word & (1ull << (index % 64));
+}
+
+static inline void
+unit_set_done(struct search *search, uint64_t index)
+{
+    __atomic_fetch_or(&search->done[index / 64], 1ull << (index % 64),
+                      __ATOMIC_RELAXED);
+}
+
+/* Returns the number of digits of the unit with the given global index */
+static unsigned
+unit_digits(const struct search *search, uint64_t index)
+{
+    unsigned lo = 0, hi = search->config->max_digits -
+                          search->config->min_digits + 1;
+    while (hi - lo > 1) {
+        unsigned mid = (lo + hi) / 2;
+        if (search->unit_offsets[mid] <= index)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return search->config->min_digits + lo;
+}
+
+static void
+search_init(struct search *search, const struct search_config *config,
+            unsigned num_threads)
+{
+    memset(search, 0, sizeof(*search));
+    search->config = config;
+    search->num_threads = num_threads;
+    pthread_mutex_init(&search->checkpoint_mtx, NULL);
+    pthread_mutex_init(&search->report_mtx, NULL);
+
+    const unsigned num_digits = config->max_digits - config->min_digits + 1;
+    search->unit_offsets = malloc((num_digits + 1) *
+                                  sizeof(*search->unit_offsets));
+    for (unsigned i = 0; i < num_digits; i++) {
+        const unsigned units = digits_num_units(config->min_digits + i);
+        search->unit_offsets[i] = search->num_units;
+        search->num_units += units;
+        search->work_total += (uint64_t)units * (config->min_digits + i);
+    }
+    search->unit_offsets[num_digits] = search->num_units;
+    search->done = calloc(DIV_ROUND_UP(search->num_units, 64) + 1,
+                          sizeof(*search->done));
+
+    if (config->progress_interval) {
+        const unsigned num_buckets =
+            (config->max_digits - 1) / config->progress_interval + 1;
+        search->units_left = calloc(num_buckets, sizeof(*search->units_left));
+        for (unsigned d = config->min_digits; d <= config->max_digits; d++) {
+            search->units_left[(d - 1) / config->progress_interval] +=
+                digits_num_units(d);
+        }
+    }
+
+    if (num_threads) {
+        search->threads = aligned_alloc(64, num_threads *
+                                            sizeof(*search->threads));
+        /* Each thread clears its own so the pages land on its node */
+#ifdef USE_OPENMP
+        #pragma omp parallel for schedule(static, 1) num_threads(num_threads)
+#endif
+        for (unsigned i = 0; i < num_threads; i++) {
+            numa_bind_thread(thread_index());
+            memset(&search->threads[i], 0, sizeof(search->threads[i]));
+        }
+        for (unsigned i = 0; i < num_threads; i++)
+            pthread_mutex_init(&search->threads[i].mtx, NULL);
+    }
+
+    search->next_checkpoint_ns = now_ns() +
+                                 config->checkpoint_interval * 1000000000ull;
+
+    /* The tables are global but only one search runs at a time */
+    power_tables_init(config->max_digits,
+                      (size_t)config->power_table_mb << 20);
+}
+
+static void
+search_finish(struct search *search)
+{
+    for (unsigned i = 0; i < search->num_threads; i++) {
+        pthread_mutex_destroy(&search->threads[i].mtx);
+        free(search->threads[i].hits.hits);
+        free(search->threads[i].done_units);
+        free(search->threads[i].found.items);
+    }
+    free(search->threads);
+    free(search->unit_offsets);
+    free(search->done);
+    free(search->base_hits.hits);
+    free(search->units_left);
+    pthread_mutex_destroy(&search->checkpoint_mtx);
+    pthread_mutex_destroy(&search->report_mtx);
+
+    power_tables_finish();
+}
+
+/* Starts the clock for throughput and time estimates.  Anything done
+ * before this, such as units loaded from a checkpoint, doesn't count.
+ */
+static void
+search_start(struct search *search)
+{
+    search->start_ns = now_ns();
+    search->work_start = search->work_done;
+    search->next_report_ns = search->start_ns +
+                             search->config->report_interval * 1000000000ull;
+}
+
+/* Records that num_units units with the given number of digits are done and
+ * reports it if that finishes off a progress bucket.
+ */
+static void
+search_progress(struct search *search, unsigned digits, uint64_t num_units)
+{
+    const struct search_config *config = search->config;
+
+    __atomic_fetch_add(&search->work_done, num_units * digits,
+                       __ATOMIC_RELAXED);
+
+    if (!search->units_left)
+        return;
+
+    unsigned bucket = (digits - 1) / config->progress_interval;
+    if (__sync_sub_and_fetch(&search->units_left[bucket], num_units) == 0) {
+        unsigned first = MAX2(bucket * config->progress_interval + 1,
+                              config->min_digits);
+        unsigned last = MIN2((bucket + 1) * config->progress_interval,
+                             config->max_digits);
+        fprintf(stderr, "Finished searching %u-%u digits\n", first, last);
+        fflush(stderr);
+    }
+}
+
+/** Verification
+ *
+ * --verify checks the search against the simplest way there is to do it:
+ * peeling one decimal digit at a time off the number itself, as the first
+ * version of this program did.  Every number printed is checked and so is
+ * a sample of the other candidates, nearly all of which were settled by
+ * the rejection stage.  The sample is picked by a hash of the candidate so
+ * it's the same whatever order the threads get to them in.
+ */
+static uint64_t verify_checked;
+static uint64_t verify_failed;
+
+/* Destroys in */
+static void
+naive_mul_digits(mpz_t out, mpz_t in)
+{
+    unsigned hist[10] = { 0, };
+
+    while (mpz_cmp_ui(in, 0) > 0) {
+        unsigned r = mpz_tdiv_q_ui(in, in, 10);
+        if (r == 0) {
+            mpz_set_ui(out, 0);
+            return;
+        }
+        hist[r]++;
+    }
+
+    hist[2] += (hist[4] * 2) + hist[6] + (hist[8] * 3);
+    hist[3] += hist[6] + (hist[9] * 2);
+
+    mpz_ui_pow_ui(out, 2, hist[2]);
+
+    mpz_t pow;
+    mpz_init(pow);
+
+    if (hist[3]) {
+        mpz_ui_pow_ui(pow, 3, hist[3]);
+        mpz_mul(out, out, pow);
+    }
+    if (hist[5]) {
+        mpz_ui_pow_ui(pow, 5, hist[5]);
+        mpz_mul(out, out, pow);
+    }
+    if (hist[7]) {
+        mpz_ui_pow_ui(pow, 7, hist[7]);
+        mpz_mul(out, out, pow);
+    }
+
+    mpz_clear(pow);
+}
+
+/* Destroys in */
+static unsigned
+naive_persistence(mpz_t in)
+{
+    mpz_t tmp;
+    mpz_init(tmp);
+
+    unsigned count;
+    for (count = 0; mpz_cmp_ui(in, 10) >= 0; count++) {
+        naive_mul_digits(tmp, in);
+        mpz_swap(tmp, in);
+    }
+
+    mpz_clear(tmp);
+
+    return count;
+}
+
+static bool
+verify_sampled(const struct search_config *config,
+               const struct candidate *cand)
+{
+    if (config->verify_sample == 0)
+        return false;
+
+    /* splitmix64's finalizer over the whole candidate */
+    uint64_t h = (uint64_t)(cand->prefix - prefixes) << 56 ^
+                 (uint64_t)cand->num5s << 42 ^ (uint64_t)cand->num7s << 28 ^
+                 (uint64_t)cand->num8s << 14 ^ cand->num9s;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    h ^= h >> 31;
+
+    return h % config->verify_sample == 0;
+}
+
+/* Checks that cand really has the given persistence */
+static void
+verify_candidate(unsigned persistence, const struct candidate *cand)
+{
+    struct out_buf buf = { NULL, };
+    out_candidate_digits(&buf, cand);
+    out_buf_fill(&buf, '\0', 1);
+
+    mpz_t num;
+    mpz_init_set_str(num, buf.data, 10);
+    const unsigned expected = naive_persistence(num);
+    mpz_clear(num);
+
+    __atomic_fetch_add(&verify_checked, 1, __ATOMIC_RELAXED);
+    if (expected != persistence) {
+        __atomic_fetch_add(&verify_failed, 1, __ATOMIC_RELAXED);
+
+        const struct output_options opts = { .format = OUTPUT_TEXT, };
+        buf.len = 0;
+        out_buf_printf(&buf, "Verification failed: found %02u but it's "
+                       "%02u for ", persistence, expected);
+        out_candidate(&buf, &opts, cand);
+        out_buf_printf(&buf, "\n");
+        out_buf_flush(&buf, stderr);
+    }
+    out_buf_finish(&buf);
+}
+
+#ifndef PERSISTENCE_LIBRARY
+/* Checks the smallest number for each persistence which gets printed */
+static void
+verify_results(const struct search_config *config,
+               const struct persistence_results *results)
+{
+    for (unsigned p = config->min_persistence; p < MAX_PERSISTENCE; p++) {
+        if (results->count[p])
+            verify_candidate(p, &results->witness[p]);
+    }
+}
+
+/* Returns false if anything failed */
+static bool
+verify_report(void)
+{
+    fprintf(stderr, "Verified %" PRIu64 " numbers against the naive product "
+            "of digits: %" PRIu64 " failed\n", verify_checked, verify_failed);
+    return verify_failed == 0;
+}
+#endif
+
+/* Adds a fully evaluated candidate to the results */
+static void
+search_found(const struct search_config *config, struct search_thread *thread,
+             struct persistence_results *results, unsigned persistence,
+             const struct candidate *cand)
+{
+    results_add(results, persistence, 1, cand);
+    if (config->verify &&
+        ((config->output.all && persistence >= config->min_persistence) ||
+         verify_sampled(config, cand)))
+        verify_candidate(persistence, cand);
+    if (thread->census.count)
+        census_add(&thread->census, cand, persistence);
+    if (config->found && persistence >= config->min_persistence) {
+        struct persistence_number num;
+        candidate_to_number(cand, &num);
+        config->found(config->found_data, persistence, &num);
+    }
+    if (config->output.all && persistence >= config->min_persistence) {
+        if (config->deterministic) {
+            found_list_append(&thread->found, persistence, cand);
+        } else {
+            out_candidate_line(&thread->out, &config->output, "candidate",
+                               persistence, cand);
+        }
+    }
+}
+
+#ifndef PERSISTENCE_LIBRARY
+/* Prints what --deterministic held back, sorted */
+static void
+search_print_found(struct search *search)
+{
+    struct found_list all = { NULL, };
+    for (unsigned i = 0; i < search->num_threads; i++) {
+        struct found_list *found = &search->threads[i].found;
+        for (size_t j = 0; j < found->len; j++) {
+            found_list_append(&all, found->items[j].persistence,
+                              &found->items[j].cand);
+        }
+        free(found->items);
+        *found = (struct found_list) { NULL, };
+    }
+
+    if (all.len)
+        qsort(all.items, all.len, sizeof(*all.items), found_cand_cmp);
+
+    struct out_buf buf = { NULL, };
+    for (size_t i = 0; i < all.len; i++) {
+        out_candidate_line(&buf, &search->config->output, "candidate",
+                           all.items[i].persistence, &all.items[i].cand);
+        if (buf.len >= OUTPUT_FLUSH_BYTES)
+            out_buf_flush(&buf, stdout);
+    }
+    out_buf_flush(&buf, stdout);
+    out_buf_finish(&buf);
+    free(all.items);
+}
+#endif
+
+/** Rejection stage
+ *
+ * Nearly every candidate has a zero in its first product of digits and
+ * that's the end of it.  That first step is the same regular computation
+ * for every candidate of a unit so it sits behind an interface which
+ * takes a whole unit at a time, leaving room for a backend which farms it
+ * out to an accelerator.  A backend adds the candidates it settles to the
+ * results and hands back the rest, which take the GMP path in
+ * search_survivors().  It may hand back candidates it couldn't decide;
+ * they're handled the same way.
+ *
+ * There are two backends.  "batch" runs the step across lanes of vector
+ * registers for units of BATCH_MIN_DIGITS to batch_max_digits digits and
+ * hands the rest to "cpu", which takes one candidate at a time with the
+ * digit kernels.  --reject-backend picks one by name.  Otherwise the first
+ * in reject_backends[] that's supported here is used, which is batch
+ * since both work on any CPU.
+ */
+struct reject_backend {
+    const char *name;
+    bool (*supported)(void);
+    /* Counts every candidate of the unit and adds the ones whose first
+     * product is a single digit or has a zero in it to results.  The rest
+     * get appended to survivors.
+     */
+    void (*reject_unit)(const struct search_config *config,
+                        struct search_thread *thread,
+                        const struct work_unit *unit,
+                        struct persistence_results *results,
+                        struct candidate_list *survivors);
+};
+
+static bool
+reject_backend_always_supported(void)
+{
+    return true;
+}
+
+static void
+reject_unit_cpu(const struct search_config *config,
+                struct search_thread *thread, const struct work_unit *unit,
+                struct persistence_results *results,
+                struct candidate_list *survivors)
+{
+    struct candidate_iter *iter = &thread->iter;
+    struct persistence_stats *stats = &thread->ws.stats;
+
+    candidate_iter_start(iter, unit->prefix, unit->digits,
+                         unit->row_begin, unit->row_end);
+    while (candidate_iter_next(iter)) {
+        stats->candidates++;
+
+        if (mpz_cmp_ui(iter->num, 10) < 0) {
+            search_found(config, thread, results, 1, &iter->cand);
+            continue;
+        }
+
+        bool zero;
+        native_uint v;
+        if (mpz_to_native(iter->num, &v)) {
+            zero = native_digit_prod(v) == 0;
+        } else {
+            /* digit_exps() destroys its input */
+            unsigned exps[NUM_PRIMES];
+            mpz_set(thread->num, iter->num);
+            zero = !digit_exps(exps, thread->num, &thread->ws);
+        }
+
+        if (zero) {
+            stats_zero_exit(stats, 2);
+            search_found(config, thread, results, 2, &iter->cand);
+        } else {
+            candidate_list_append(survivors, &iter->cand);
+        }
+    }
+}
+
+/* Records the outcome of the first step of cand */
+static inline void
+reject_record(const struct search_config *config,
+              struct search_thread *thread,
+              struct persistence_results *results,
+              struct candidate_list *survivors,
+              const struct candidate *cand, bool zero)
+{
+    struct persistence_stats *stats = &thread->ws.stats;
+
+    stats->candidates++;
+    if (zero) {
+        stats_zero_exit(stats, 2);
+        search_found(config, thread, results, 2, cand);
+    } else {
+        candidate_list_append(survivors, cand);
+    }
+}
+
+/** Lane-parallel rejection for small candidates
+ *
+ * This walks a row segment at a time, one segment per lane, on first products
+ * kept in base 10^4 so there's no conversion to decimal at all.  Within a
+ * row, each candidate's product is the one before times 9/7 or 9/8 which
+ * is a pass from the bottom for the 9 and one from the top for the
+ * division.  The zero test rides along with the division.  Limbs are laid
+ * out with the lanes innermost so every one of those loops vectorizes
+ * across lanes.  A lane which runs out of segment gets the next one while
+ * the others carry on.
+ *
+ * Each lane starts from a product built with GMP and converted once.  With
+ * 32 candidates per segment that's cheap enough that the batch wins at
+ * every size it handles.  Above that, the numbers are big enough for GMP
+ * to do well on its own.
+ */
+
+/* Multiplies every lane by 9 and divides it by its divisor, setting zero
+ * for each lane whose result has a zero digit.  Inlined into one copy per
+ * size class so the limb loops have a fixed trip count.
+ */
+static inline __attribute__((always_inline)) void
+batch_step(struct batch_lanes *restrict b, const unsigned num_limbs)
+{
+    /* Everything is kept below 2^32 so the multiplies are plain 32-bit
+     * ones, which every vector unit has.
+     */
+    batch_vec carry = { 0, };
+    for (unsigned i = 0; i < num_limbs; i++) {
+        /* t < 2^17 and t / 10^4 = (t / 16) / 625 */
+        batch_vec t = b->limbs[i] * 9 + carry;
+        carry = ((t >> 4) * 6711) >> 22;
+        b->limbs[i] = t - carry * BATCH_LIMB_BASE;
+    }
+
+    /* With 10^4 = d * quot + rem, (r * 10^4 + x) / d is
+     * r * quot + (r * rem + x) / d and the last one is small.
+     */
+    batch_vec r = { 0, }, started = { 0, }, zero = { 0, };
+    for (unsigned i = num_limbs; i-- > 0;) {
+        /* The divisor is 7 or 8 so the remainder of 10^4 is 4 or 0 and
+         * the only multiply left on the chain from one limb to the next
+         * is the one for u / d.
+         */
+        batch_vec u = ((r << 2) & b->is7) + b->limbs[i];
+        batch_vec uq = (u * b->magic) >> 16;
+        batch_vec q = r * b->base_quot + uq;
+        r = u - ((uq << 3) - (uq & b->is7));
+        b->limbs[i] = q;
+
+        /* x * 52429 >> 19 is x / 10 for x < 43699 */
+        batch_vec q1 = (q * 52429) >> 19, d0 = q - q1 * 10;
+        batch_vec q2 = (q1 * 52429) >> 19, d1 = q1 - q2 * 10;
+        batch_vec d3 = (q2 * 52429) >> 19, d2 = q2 - d3 * 10;
+
+        /* Below the top limb every digit counts.  In the top limb, only
+         * the ones below the leading digit do.  Comparisons give all ones
+         * or all zeros in each lane.
+         */
+        batch_vec full = started;
+        batch_vec nonzero = (batch_vec)(q != 0);
+        zero |= (nonzero | full) &
+                ((batch_vec)(d0 == 0) |
+                 ((batch_vec)(d1 == 0) & (full | (batch_vec)(q >= 10))) |
+                 ((batch_vec)(d2 == 0) & (full | (batch_vec)(q >= 100))) |
+                 ((batch_vec)(d3 == 0) & full));
+        started |= nonzero;
+    }
+
+    b->zero = zero;
+}
+
+#define BATCH_CLASS(n) \
+    static void batch_step_##n(struct batch_lanes *b) { batch_step(b, n); }
+BATCH_CLASS(16)
+BATCH_CLASS(32)
+BATCH_CLASS(48)
+BATCH_CLASS(64)
+BATCH_CLASS(80)
+#undef BATCH_CLASS
+
+static const struct batch_class {
+    unsigned limbs;
+    void (*step)(struct batch_lanes *b);
+} batch_classes[] = {
+    { 16, batch_step_16 },
+    { 32, batch_step_32 },
+    { 48, batch_step_48 },
+    { 64, batch_step_64 },
+    { 80, batch_step_80 },
+};
+#define NUM_BATCH_CLASSES (sizeof(batch_classes) / sizeof(batch_classes[0]))
+
+static const struct batch_class *
+batch_class_for(unsigned digits)
+{
+    if (digits < BATCH_MIN_DIGITS || digits > batch_max_digits)
+        return NULL;
+
+    /* A product of digits has fewer digits than the number and we need
+     * room for one more 9 before each division.
+     */
+    for (unsigned i = 0; i < NUM_BATCH_CLASSES; i++) {
+        if (batch_classes[i].limbs * 4 >= digits + 2)
+            return &batch_classes[i];
+    }
+    return NULL;
+}
+
+/* Starts lane l on the segment of cand's row starting at cand, with left
+ * more candidates after it, and records cand itself.
+ */
+static void
+batch_seed(struct batch_lanes *b, unsigned l, unsigned num_limbs,
+           const struct candidate *cand, unsigned left, mpz_t scratch,
+           struct workspace *ws, bool *zero)
+{
+    size_t len;
+    candidate_product(scratch, cand, ws);
+    const unsigned char *str = digit_str(scratch, ws, &len);
+    *zero = memchr(str, 0, len) != NULL;
+
+    for (unsigned i = 0; i < num_limbs; i++) {
+        uint32_t limb = 0;
+        for (unsigned k = 4; k > 0; k--) {
+            const size_t pos = (size_t)i * 4 + k;
+            limb = limb * 10 + (pos <= len ? str[len - pos] : 0);
+        }
+        b->limbs[i][l] = limb;
+    }
+
+    /* Trading 7s for 9s if there are 5s in the row, 8s otherwise */
+    const uint32_t d = cand->num5s ? 7 : 8;
+    b->is7[l] = d == 7 ? ~0u : 0;
+    b->base_quot[l] = BATCH_LIMB_BASE / d;
+    b->magic[l] = ((1u << 16) + d - 1) / d;
+    b->cand[l] = *cand;
+    b->left[l] = left;
+}
+
+static void
+reject_unit_batch(const struct search_config *config,
+                  struct search_thread *thread, const struct work_unit *unit,
+                  struct persistence_results *results,
+                  struct candidate_list *survivors)
+{
+    const struct batch_class *cls = batch_class_for(unit->digits);
+    if (!cls) {
+        reject_unit_cpu(config, thread, unit, results, survivors);
+        return;
+    }
+
+    struct batch_lanes *b = &thread->batch;
+    const unsigned tail_digits = unit->digits - unit->prefix->digits;
+    const unsigned five_rows = (unit->prefix->prod & 1) ? tail_digits : 0;
+
+    /* Next segment to hand out */
+    unsigned row = unit->row_begin, offset = 0;
+    struct candidate row_cand = { .prefix = unit->prefix };
+    unsigned row_len = 0;
+    if (row < unit->row_end)
+        row_len = candidate_row_start(&row_cand, tail_digits, five_rows, row);
+
+    for (unsigned l = 0; l < BATCH_LANES; l++)
+        b->left[l] = 0;
+
+    while (true) {
+        unsigned busy = 0;
+        for (unsigned l = 0; l < BATCH_LANES; l++) {
+            while (b->left[l] == 0 && row < unit->row_end) {
+                struct candidate cand = row_cand;
+                if (cand.num5s)
+                    cand.num7s -= offset;
+                else
+                    cand.num8s -= offset;
+                cand.num9s = offset;
+                const unsigned seg_len = MIN2(BATCH_SEGMENT, row_len - offset);
+
+                bool zero;
+                batch_seed(b, l, cls->limbs, &cand, seg_len - 1, thread->num,
+                           &thread->ws, &zero);
+                reject_record(config, thread, results, survivors, &cand, zero);
+
+                offset += seg_len;
+                if (offset == row_len && ++row < unit->row_end) {
+                    offset = 0;
+                    row_len = candidate_row_start(&row_cand, tail_digits,
+                                                  five_rows, row);
+                }
+            }
+
+            /* Idle lanes are left with an exhausted segment and keep
+             * computing garbage which nobody looks at.
+             */
+            busy += b->left[l] != 0;
+        }
+        if (busy == 0)
+            break;
+
+        cls->step(b);
+
+        for (unsigned l = 0; l < BATCH_LANES; l++) {
+            if (b->left[l] == 0)
+                continue;
+
+            struct candidate *cand = &b->cand[l];
+            if (cand->num5s)
+                cand->num7s--;
+            else
+                cand->num8s--;
+            cand->num9s++;
+            b->left[l]--;
+            reject_record(config, thread, results, survivors, cand,
+                          b->zero[l]);
+        }
+    }
+}
+
+static const struct reject_backend reject_backends[] = {
+    { "batch", reject_backend_always_supported, reject_unit_batch },
+    { "cpu", reject_backend_always_supported, reject_unit_cpu },
+};
+#define NUM_REJECT_BACKENDS \
+    (sizeof(reject_backends) / sizeof(reject_backends[0]))
+
+static const struct reject_backend *reject_backend = &reject_backends[0];
+
+/* Picks the backend called name or, if name is NULL, the first one which
+ * works on this machine.  Must be called before any threads are started.
+ */
+static bool
+select_reject_backend(const char *name)
+{
+    for (unsigned i = 0; i < NUM_REJECT_BACKENDS; i++) {
+        if (name ? strcmp(reject_backends[i].name, name) != 0 :
+                   !reject_backends[i].supported())
+            continue;
+
+        if (!reject_backends[i].supported()) {
+            fprintf(stderr, "Rejection backend %s isn't supported here\n",
+                    name);
+            return false;
+        }
+        reject_backend = &reject_backends[i];
+        return true;
+    }
+
+    if (!name) {
+        fprintf(stderr, "No rejection backend is supported here\n");
+        return false;
+    }
+
+    fprintf(stderr, "Unknown rejection backend %s; available:", name);
+    for (unsigned i = 0; i < NUM_REJECT_BACKENDS; i++)
+        fprintf(stderr, " %s", reject_backends[i].name);
+    fprintf(stderr, "\n");
+    return false;
+}
+
+/* Takes the candidates which got past the rejection stage the rest of the
+ * way and adds them to results
+ */
+static void
+search_survivors(const struct search_config *config,
+                 struct search_thread *thread,
+                 const struct candidate_list *survivors,
+                 struct persistence_results *results)
+{
+    for (size_t i = 0; i < survivors->len; i++) {
+        const struct candidate *cand = &survivors->cands[i];
+        struct persistence_stats *stats = &thread->ws.stats;
+
+        /* The backend doesn't hand back products so we rebuild them.  So
+         * few candidates survive that it doesn't matter.
+         */
+        candidate_product(thread->num, cand, &thread->ws);
+
+        if (config->exponent_search) {
+            struct exps_hit hit = { .cand = *cand, .count = 1 };
+            if (mpz_cmp_ui(thread->num, 10) < 0) {
+                results_add(results, 1, 1, cand);
+            } else if (!digit_exps(hit.exps, thread->num, &thread->ws)) {
+                stats_zero_exit(stats, 2);
+                results_add(results, 2, 1, cand);
+            } else if (dead_set.bits && dead_set_lookup(hit.exps)) {
+                stats->pruned++;
+                results->pruned++;
+            } else {
+                exps_hit_list_append(&thread->unit_hits, &hit);
+            }
+        } else if (dead_set.bits) {
+            /* Same as below but we take the first step by hand so we can
+             * look at the second product before building it.
+             */
+            unsigned exps[NUM_PRIMES];
+            if (mpz_cmp_ui(thread->num, 10) < 0) {
+                search_found(config, thread, results, 1, cand);
+            } else if (!digit_exps(exps, thread->num, &thread->ws)) {
+                stats_zero_exit(stats, 2);
+                search_found(config, thread, results, 2, cand);
+            } else if (dead_set_lookup(exps)) {
+                stats->pruned++;
+                results->pruned++;
+            } else {
+                bool zero;
+                unsigned persistence =
+                    2 + exps_persistence(thread->num, exps, &thread->ws,
+                                         &zero);
+                if (zero)
+                    stats_zero_exit(stats, persistence);
+                dead_set_record(exps, persistence - 2);
+                search_found(config, thread, results, persistence, cand);
+            }
+        } else {
+            bool zero;
+            unsigned persistence =
+                1 + mpz_persistence(thread->num, &thread->ws, &zero);
+            if (zero)
+                stats_zero_exit(stats, persistence);
+            search_found(config, thread, results, persistence, cand);
+        }
+    }
+}
+
+static void
+search_unit(const struct search_config *config, struct search_thread *thread,
+            const struct work_unit *unit, struct persistence_results *results)
+{
+    struct candidate_list *survivors = &thread->survivors;
+    survivors->len = 0;
+    reject_backend->reject_unit(config, thread, unit, results, survivors);
+    search_survivors(config, thread, survivors, results);
+}
+
+static void
+search_thread_finish_unit(struct search *search, struct search_thread *thread,
+                          uint64_t index,
+                          const struct persistence_results *results)
+{
+    /* Once the unit is in a checkpoint, --resume skips it, so its --all
+     * lines have to be out before then.
+     */
+    if (thread->out.len >= OUTPUT_FLUSH_BYTES ||
+        (search->config->checkpoint_path && thread->out.len))
+        out_buf_flush(&thread->out, stdout);
+
+    pthread_mutex_lock(&thread->mtx);
+
+    results_merge(&thread->results, results);
+    exps_hit_list_append_list(&thread->hits, &thread->unit_hits);
+
+    if (search->config->checkpoint_path) {
+        if (thread->num_done_units == thread->done_units_cap) {
+            thread->done_units_cap = MAX2(thread->done_units_cap * 2, 64);
+            thread->done_units =
+                realloc(thread->done_units,
+                        thread->done_units_cap * sizeof(*thread->done_units));
+        }
+        thread->done_units[thread->num_done_units++] = index;
+    }
+
+    pthread_mutex_unlock(&thread->mtx);
+
+    thread->unit_hits.len = 0;
+}
+
+/* Gathers the results of every finished unit.  Each thread's results and
+ * list of finished units are taken together under its lock so the bitmap
+ * of done units always matches the results exactly.  The caller must hold
+ * checkpoint_mtx.
+ */
+static void
+search_collect(struct search *search, struct persistence_results *results,
+               struct exps_hit_list *hits)
+{
+    *results = search->base_results;
+    hits->len = 0;
+    exps_hit_list_append_list(hits, &search->base_hits);
+
+    for (unsigned i = 0; i < search->num_threads; i++) {
+        struct search_thread *thread = &search->threads[i];
+
+        pthread_mutex_lock(&thread->mtx);
+
+        results_merge(results, &thread->results);
+        exps_hit_list_append_list(hits, &thread->hits);
+        for (size_t j = 0; j < thread->num_done_units; j++)
+            unit_set_done(search, thread->done_units[j]);
+        thread->num_done_units = 0;
+
+        pthread_mutex_unlock(&thread->mtx);
+    }
+}
+
+/* Throws away the per-thread results once they've been collected.  Must
+ * not be called while units are being searched.
+ */
+static void
+search_reset_results(struct search *search)
+{
+    for (unsigned i = 0; i < search->num_threads; i++) {
+        memset(&search->threads[i].results, 0,
+               sizeof(search->threads[i].results));
+        search->threads[i].hits.len = 0;
+    }
+}
+
+static void
+write_candidate(FILE *f, const struct candidate *cand)
+{
+    fprintf(f, "%u %u %u %u %u", (unsigned)(cand->prefix - prefixes),
+            cand->num5s, cand->num7s, cand->num8s, cand->num9s);
+}
+
+#ifndef PERSISTENCE_LIBRARY
+static bool
+read_candidate(FILE *f, struct candidate *cand)
+{
+    unsigned p;
+    if (fscanf(f, "%u %u %u %u %u", &p, &cand->num5s, &cand->num7s,
+               &cand->num8s, &cand->num9s) != 5 || p >= NUM_PREFIXES)
+        return false;
+
+    cand->prefix = &prefixes[p];
+    return true;
+}
+#endif
+
+/* Writes results in the text form shared by checkpoints and the
+ * coordinator/worker protocol.
+ */
+static void
+write_results(FILE *f, const struct persistence_results *results,
+              const struct exps_hit_list *hits)
+{
+    unsigned num_results = 0;
+    for (unsigned p = 0; p < MAX_PERSISTENCE; p++)
+        num_results += results->count[p] != 0;
+    fprintf(f, "results %u\n", num_results);
+    for (unsigned p = 0; p < MAX_PERSISTENCE; p++) {
+        if (results->count[p] == 0)
+            continue;
+
+        fprintf(f, "%u %" PRIu64 " ", p, results->count[p]);
+        write_candidate(f, &results->witness[p]);
+        fprintf(f, "\n");
+    }
+
+    fprintf(f, "hits %zu\n", hits->len);
+    for (size_t i = 0; i < hits->len; i++) {
+        const struct exps_hit *hit = &hits->hits[i];
+        for (unsigned j = 0; j < NUM_PRIMES; j++)
+            fprintf(f, "%u ", hit->exps[j]);
+        fprintf(f, "%" PRIu64 " ", hit->count);
+        write_candidate(f, &hit->cand);
+        fprintf(f, "\n");
+    }
+
+    fprintf(f, "pruned %" PRIu64 "\n", results->pruned);
+}
+
+#ifndef PERSISTENCE_LIBRARY
+static void
+write_stats(FILE *f, const struct persistence_stats *stats)
+{
+    const uint64_t *words = (const uint64_t *)stats;
+    fprintf(f, "stats %zu", STATS_NUM_WORDS);
+    for (unsigned i = 0; i < STATS_NUM_WORDS; i++)
+        fprintf(f, " %" PRIu64, words[i]);
+    fprintf(f, "\n");
+}
+
+static bool
+read_stats(FILE *f, struct persistence_stats *stats)
+{
+    uint64_t *words = (uint64_t *)stats;
+    size_t num_words;
+    if (fscanf(f, " stats %zu", &num_words) != 1 ||
+        num_words != STATS_NUM_WORDS)
+        return false;
+
+    for (unsigned i = 0; i < STATS_NUM_WORDS; i++) {
+        if (fscanf(f, "%" SCNu64, &words[i]) != 1)
+            return false;
+    }
+    return true;
+}
+
+/* Reads results written by write_results() and adds them to results and
+ * hits.
+ */
+static bool
+read_results(FILE *f, struct persistence_results *results,
+             struct exps_hit_list *hits)
+{
+    unsigned num_results;
+    if (fscanf(f, " results %u", &num_results) != 1)
+        return false;
+    for (unsigned i = 0; i < num_results; i++) {
+        unsigned p;
+        uint64_t count;
+        struct candidate cand;
+        if (fscanf(f, "%u %" SCNu64, &p, &count) != 2 ||
+            p >= MAX_PERSISTENCE || !read_candidate(f, &cand))
+            return false;
+
+        results_add(results, p, count, &cand);
+    }
+
+    size_t num_hits;
+    if (fscanf(f, " hits %zu", &num_hits) != 1)
+        return false;
+    for (size_t i = 0; i < num_hits; i++) {
+        struct exps_hit hit;
+        for (unsigned j = 0; j < NUM_PRIMES; j++) {
+            if (fscanf(f, "%u", &hit.exps[j]) != 1)
+                return false;
+        }
+        if (fscanf(f, "%" SCNu64, &hit.count) != 1 ||
+            !read_candidate(f, &hit.cand))
+            return false;
+
+        exps_hit_list_append(hits, &hit);
+    }
+
+    uint64_t pruned;
+    if (fscanf(f, " pruned %" SCNu64, &pruned) != 1)
+        return false;
+    results->pruned += pruned;
+
+    char end[4];
+    return fscanf(f, " %3s", end) == 1 && strcmp(end, "end") == 0;
+}
+#endif
+
+/** Checkpoint files
+ *
+ * A checkpoint is a small text file recording which units are done, as a
+ * list of ranges of unit indices, together with the results of those
+ * units.  Units are mostly finished in order so the list of ranges stays
+ * short.  The file is written to a temporary name and renamed over the old
+ * one so a crash mid-write leaves the previous checkpoint intact.
+ */
+#define CHECKPOINT_VERSION 4
+
+struct checkpoint_data {
+    const struct search *search;
+    struct persistence_results results;
+    struct exps_hit_list hits;
+};
+
+static bool
+checkpoint_write(FILE *f, void *data)
+{
+    const struct checkpoint_data *ckpt = data;
+    const struct search *search = ckpt->search;
+    const struct search_config *config = search->config;
+
+    fprintf(f, "persistence-checkpoint %u\n", CHECKPOINT_VERSION);
+    fprintf(f, "config %u %u %u %u %u\n", config->min_digits,
+            config->max_digits, config->exponent_search, UNIT_CANDIDATES,
+            search_config_prune_below(config));
+    fprintf(f, "units %" PRIu64 "\n", search->num_units);
+
+    uint64_t num_ranges = 0;
+    for (uint64_t u = 0; u < search->num_units; u++) {
+        if (unit_is_done(search, u) &&
+            (u == 0 || !unit_is_done(search, u - 1)))
+            num_ranges++;
+    }
+    fprintf(f, "done %" PRIu64 "\n", num_ranges);
+    for (uint64_t u = 0; u < search->num_units; u++) {
+        if (!unit_is_done(search, u))
+            continue;
+
+        uint64_t end = u + 1;
+        while (end < search->num_units && unit_is_done(search, end))
+            end++;
+        fprintf(f, "%" PRIu64 " %" PRIu64 "\n", u, end);
+        u = end;
+    }
+
+    write_results(f, &ckpt->results, &ckpt->hits);
+    fprintf(f, "end\n");
+
+    return true;
+}
+
+static bool
+write_checkpoint(struct search *search)
+{
+    struct checkpoint_data ckpt = {
+        .search = search,
+        .hits = { NULL, },
+    };
+    search_collect(search, &ckpt.results, &ckpt.hits);
+
+    const bool ok = atomic_write_file(search->config->checkpoint_path,
+                                      "checkpoint", checkpoint_write, &ckpt);
+    free(ckpt.hits.hits);
+
+    return ok;
+}
+
+#ifndef PERSISTENCE_LIBRARY
+static bool
+read_checkpoint(struct search *search)
+{
+    const struct search_config *config = search->config;
+
+    FILE *f = fopen(config->checkpoint_path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Failed to open checkpoint %s: %s\n",
+                config->checkpoint_path, strerror(errno));
+        return false;
+    }
+
+    unsigned version, min_digits, max_digits, exponent_search, unit_cands;
+    unsigned prune_below;
+    uint64_t num_units, num_ranges;
+    if (fscanf(f, "persistence-checkpoint %u\n", &version) != 1 ||
+        version != CHECKPOINT_VERSION)
+        goto fail_format;
+
+    if (fscanf(f, "config %u %u %u %u %u\n", &min_digits, &max_digits,
+               &exponent_search, &unit_cands, &prune_below) != 5 ||
+        fscanf(f, "units %" SCNu64 "\n", &num_units) != 1)
+        goto fail_format;
+
+    if (min_digits != config->min_digits ||
+        max_digits != config->max_digits ||
+        exponent_search != config->exponent_search ||
+        unit_cands != UNIT_CANDIDATES || num_units != search->num_units ||
+        prune_below != search_config_prune_below(config)) {
+        fprintf(stderr, "Checkpoint %s is for a different search "
+                "(digits %u-%u%s)\n", config->checkpoint_path,
+                min_digits, max_digits,
+                exponent_search ? ", exponent search" : "");
+        fclose(f);
+        return false;
+    }
+
+    if (fscanf(f, "done %" SCNu64 "\n", &num_ranges) != 1)
+        goto fail_format;
+    for (uint64_t i = 0; i < num_ranges; i++) {
+        uint64_t begin, end;
+        if (fscanf(f, "%" SCNu64 " %" SCNu64 "\n", &begin, &end) != 2 ||
+            begin >= end || end > num_units)
+            goto fail_format;
+
+        for (uint64_t u = begin; u < end; u++) {
+            unit_set_done(search, u);
+            search_progress(search, unit_digits(search, u), 1);
+        }
+    }
+
+    if (!read_results(f, &search->base_results, &search->base_hits))
+        goto fail_format;
+
+    fclose(f);
+    return true;
+
+fail_format:
+    fprintf(stderr, "Checkpoint %s is corrupt\n", config->checkpoint_path);
+    fclose(f);
+    return false;
+}
+#endif
+
+/* Called by worker threads between units.  Whoever gets there first once
+ * the interval is up writes the checkpoint while everyone else carries on.
+ */
+static void
+maybe_checkpoint(struct search *search)
+{
+    if (!search->config->checkpoint_path ||
+        now_ns() < __atomic_load_n(&search->next_checkpoint_ns,
+                                   __ATOMIC_RELAXED))
+        return;
+
+    if (pthread_mutex_trylock(&search->checkpoint_mtx) != 0)
+        return;
+
+    /* Someone else may have just written one */
+    if (now_ns() >= search->next_checkpoint_ns) {
+        write_checkpoint(search);
+        __atomic_store_n(&search->next_checkpoint_ns,
+                         now_ns() + search->config->checkpoint_interval *
+                                    1000000000ull,
+                         __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&search->checkpoint_mtx);
+}
+
+/** Status reports
+ *
+ * Every report_interval seconds, one thread sums up everybody's counters,
+ * prints a line to stderr and, if asked to, rewrites the status file.  The
+ * status file uses the Prometheus text format so it can be picked up by
+ * node_exporter's textfile collector or just read by a human.  Like
+ * checkpoints, it's written to a temporary file and renamed into place.
+ */
+static void
+format_duration(char *buf, size_t size, double secs)
+{
+    uint64_t s = secs;
+    if (s >= 3600) {
+        snprintf(buf, size, "%" PRIu64 "h%02um%02us", s / 3600,
+                 (unsigned)(s / 60 % 60), (unsigned)(s % 60));
+    } else if (s >= 60) {
+        snprintf(buf, size, "%um%02us", (unsigned)(s / 60),
+                 (unsigned)(s % 60));
+    } else {
+        snprintf(buf, size, "%us", (unsigned)s);
+    }
+}
+
+static void
+write_status(FILE *f, const struct search *search,
+             const struct persistence_stats *stats, double elapsed,
+             double eta)
+{
+    fprintf(f, "# HELP persistence_candidates_total Candidates tested\n");
+    fprintf(f, "# TYPE persistence_candidates_total counter\n");
+    fprintf(f, "persistence_candidates_total %" PRIu64 "\n",
+            stats->candidates);
+
+    fprintf(f, "# HELP persistence_pruned_total Candidates pruned by the "
+            "dead set\n");
+    fprintf(f, "# TYPE persistence_pruned_total counter\n");
+    fprintf(f, "persistence_pruned_total %" PRIu64 "\n", stats->pruned);
+
+    fprintf(f, "# HELP persistence_bignum_ops_total Bignum digit products "
+            "and exponent vector products\n");
+    fprintf(f, "# TYPE persistence_bignum_ops_total counter\n");
+    fprintf(f, "persistence_bignum_ops_total{op=\"conversion\"} %" PRIu64
+            "\n", stats->conversions);
+    fprintf(f, "persistence_bignum_ops_total{op=\"multiply\"} %" PRIu64 "\n",
+            stats->multiplies);
+
+    fprintf(f, "# HELP persistence_probe_rejects_total Big conversions "
+            "skipped for a zero in the low digits\n");
+    fprintf(f, "# TYPE persistence_probe_rejects_total counter\n");
+    fprintf(f, "persistence_probe_rejects_total %" PRIu64 "\n",
+            stats->probe_rejects);
+
+    fprintf(f, "# HELP persistence_zero_exits_total Chains ended by a zero, "
+            "by step\n");
+    fprintf(f, "# TYPE persistence_zero_exits_total counter\n");
+    for (unsigned i = 0; i < STATS_MAX_STEP; i++) {
+        if (stats->zero_exits[i]) {
+            fprintf(f, "persistence_zero_exits_total{step=\"%u%s\"} %" PRIu64
+                    "\n", i, i == STATS_MAX_STEP - 1 ? "+" : "",
+                    stats->zero_exits[i]);
+        }
+    }
+
+    fprintf(f, "# HELP persistence_phase_seconds_total Estimated time in "
+            "each phase, summed over threads\n");
+    fprintf(f, "# TYPE persistence_phase_seconds_total counter\n");
+    for (unsigned i = 0; i < NUM_PHASES; i++) {
+        fprintf(f, "persistence_phase_seconds_total{phase=\"%s\"} %.3f\n",
+                phase_names[i], stats->phase_ns[i] * 1e-9);
+    }
+
+    fprintf(f, "# HELP persistence_cache_lookups_total Persistence cache "
+            "lookups\n");
+    fprintf(f, "# TYPE persistence_cache_lookups_total counter\n");
+    fprintf(f, "persistence_cache_lookups_total{result=\"hit\"} %" PRIu64
+            "\n", stats->cache_hits);
+    fprintf(f, "persistence_cache_lookups_total{result=\"miss\"} %" PRIu64
+            "\n", stats->cache_misses);
+
+    fprintf(f, "# HELP persistence_store_lookups_total Product store "
+            "lookups\n");
+    fprintf(f, "# TYPE persistence_store_lookups_total counter\n");
+    fprintf(f, "persistence_store_lookups_total{result=\"hit\"} %" PRIu64
+            "\n", stats->store_hits);
+    fprintf(f, "persistence_store_lookups_total{result=\"miss\"} %" PRIu64
+            "\n", stats->store_misses);
+
+    fprintf(f, "# HELP persistence_elapsed_seconds Time since the search "
+            "started\n");
+    fprintf(f, "# TYPE persistence_elapsed_seconds gauge\n");
+    fprintf(f, "persistence_elapsed_seconds %.1f\n", elapsed);
+
+    if (eta >= 0) {
+        fprintf(f, "# HELP persistence_progress_ratio Estimated fraction of "
+                "the search done\n");
+        fprintf(f, "# TYPE persistence_progress_ratio gauge\n");
+        fprintf(f, "persistence_progress_ratio %.6f\n",
+                (double)search->work_done / search->work_total);
+
+        fprintf(f, "# HELP persistence_eta_seconds Estimated time left\n");
+        fprintf(f, "# TYPE persistence_eta_seconds gauge\n");
+        fprintf(f, "persistence_eta_seconds %.0f\n", eta);
+    }
+}
+
+struct status_data {
+    const struct search *search;
+    const struct persistence_stats *stats;
+    double elapsed;
+    double eta;
+};
+
+static bool
+status_write(FILE *f, void *data)
+{
+    const struct status_data *status = data;
+    write_status(f, status->search, status->stats, status->elapsed,
+                 status->eta);
+    return true;
+}
+
+static void
+search_report_status(struct search *search)
+{
+    const struct search_config *config = search->config;
+
+    struct persistence_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    persistence_stats_add_published(&stats, &search->stats);
+    for (unsigned i = 0; i < search->num_threads; i++)
+        persistence_stats_add_published(&stats, &search->threads[i].live_stats);
+
+    const double elapsed = (now_ns() - search->start_ns) * 1e-9;
+    const uint64_t work_done =
+        __atomic_load_n(&search->work_done, __ATOMIC_RELAXED);
+
+    /* Workers only see their own leases so they can't say much about the
+     * search as a whole.
+     */
+    double eta = -1;
+    if (!config->connect_addr && work_done > search->work_start) {
+        double rate = (work_done - search->work_start) / elapsed;
+        eta = (search->work_total - work_done) / rate;
+    }
+
+    char elapsed_str[32], eta_str[32];
+    format_duration(elapsed_str, sizeof(elapsed_str), elapsed);
+    if (eta >= 0) {
+        format_duration(eta_str, sizeof(eta_str), eta);
+        fprintf(stderr, "Status: %.1f%% done in %s, %.3g candidates/s, "
+                "ETA %s\n", 100.0 * work_done / search->work_total,
+                elapsed_str, stats.candidates / elapsed, eta_str);
+    } else {
+        fprintf(stderr, "Status: %" PRIu64 " candidates in %s, %.3g "
+                "candidates/s\n", stats.candidates, elapsed_str,
+                stats.candidates / elapsed);
+    }
+    fflush(stderr);
+
+    if (!config->status_path)
+        return;
+
+    struct status_data status = {
+        .search = search,
+        .stats = &stats,
+        .elapsed = elapsed,
+        .eta = eta,
+    };
+    atomic_write_file(config->status_path, "status file", status_write,
+                      &status);
+}
+
+/* Same idea as maybe_checkpoint() */
+static void
+maybe_report(struct search *search)
+{
+    if (!search->config->report_interval ||
+        now_ns() < __atomic_load_n(&search->next_report_ns, __ATOMIC_RELAXED))
+        return;
+
+    if (pthread_mutex_trylock(&search->report_mtx) != 0)
+        return;
+
+    if (now_ns() >= search->next_report_ns) {
+        search_report_status(search);
+        __atomic_store_n(&search->next_report_ns,
+                         now_ns() + search->config->report_interval *
+                                    1000000000ull,
+                         __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&search->report_mtx);
+}
+
+/* Everything that's left once a unit has been searched */
+static void
+search_thread_done_unit(struct search *search, struct search_thread *thread,
+                        unsigned digits, uint64_t index,
+                        const struct persistence_results *results)
+{
+    search_thread_finish_unit(search, thread, index, results);
+    persistence_stats_publish(&thread->live_stats, &thread->ws.stats);
+
+    search_progress(search, digits, 1);
+    maybe_checkpoint(search);
+    maybe_report(search);
+}
+
+/** Pipelined search
+ *
+ * Normally each thread takes a unit through both stages before starting
+ * the next one.  With --pipeline, the rejection stage puts each unit's
+ * survivors in a batch on a bounded queue and any thread may take them
+ * the rest of the way.  Threads don't have fixed roles.  A thread generates
+ * while the queue is less than half full and evaluates otherwise, and when
+ * the queue is full it evaluates the batch it just made.  That way every
+ * thread stays busy however the time splits between the two stages.  Units
+ * are handed out in the same order as without the pipeline and the results
+ * are the same.
+ *
+ * The queue is the usual bounded MPMC queue with a sequence number in
+ * each cell (Vyukov's), so neither side takes a lock.  Batches go back
+ * through a second queue of free ones and keep their survivor lists for
+ * the next unit.  There is one batch for each slot in the queue plus one
+ * per thread, so there's always a free batch.  It may still be on its way
+ * back from another thread, though.
+ */
+#define PIPELINE_BATCHES_PER_THREAD 4
+
+struct mpmc_cell {
+    uint64_t seq;
+    void *data;
+};
+
+struct mpmc_queue {
+    struct mpmc_cell *cells;
+    uint64_t mask;
+    /* On their own cache lines since every push and pop bangs on one */
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+static void
+mpmc_queue_init(struct mpmc_queue *q, uint64_t min_size)
+{
+    uint64_t size = 1;
+    while (size < min_size)
+        size *= 2;
+
+    q->cells = malloc(size * sizeof(*q->cells));
+    for (uint64_t i = 0; i < size; i++)
+        q->cells[i] = (struct mpmc_cell) { .seq = i, .data = NULL };
+    q->mask = size - 1;
+    q->head = 0;
+    q->tail = 0;
+}
+
+static void
+mpmc_queue_finish(struct mpmc_queue *q)
+{
+    free(q->cells);
+}
+
+static uint64_t
+mpmc_queue_size(const struct mpmc_queue *q)
+{
+    return q->mask + 1;
+}
+
+/* Returns false if the queue is full */
+static bool
+mpmc_queue_push(struct mpmc_queue *q, void *data)
+{
+    uint64_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    while (true) {
+        struct mpmc_cell *cell = &q->cells[pos & q->mask];
+        const uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        const int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            /* A failed exchange leaves the current tail in pos */
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                cell->data = data;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Returns NULL if the queue is empty or the only things in it are still
+ * being pushed
+ */
+static void *
+mpmc_queue_pop(struct mpmc_queue *q)
+{
+    uint64_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    while (true) {
+        struct mpmc_cell *cell = &q->cells[pos & q->mask];
+        const uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        const int64_t diff = (int64_t)(seq - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                void *data = cell->data;
+                __atomic_store_n(&cell->seq, pos + q->mask + 1,
+                                 __ATOMIC_RELEASE);
+                return data;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Only a hint while other threads are pushing and popping */
+static uint64_t
+mpmc_queue_len(const struct mpmc_queue *q)
+{
+    const uint64_t head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    const uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    return tail > head ? tail - head : 0;
+}
+
+struct pipeline_batch {
+    struct persistence_results results;
+    struct candidate_list survivors;
+    uint64_t index;
+    unsigned digits;
+    /* Thread which generated it */
+    unsigned thread;
+};
+
+/* Units [first, first + count) of one number of digits, which come at
+ * position pos in the order they're handed out
+ */
+struct pipeline_span {
+    uint64_t pos;
+    uint64_t first;
+    uint64_t count;
+    unsigned digits;
+};
+
+struct pipeline {
+    struct search *search;
+
+    struct pipeline_span *spans;
+    unsigned num_spans;
+    uint64_t num_units;
+
+    struct pipeline_batch *batches;
+    unsigned num_batches;
+    struct mpmc_queue full;
+    struct mpmc_queue free;
+
+    /* Position of the next unit to generate */
+    uint64_t next __attribute__((aligned(64)));
+};
+
+static void
+pipeline_init(struct pipeline *pipe, struct search *search, uint64_t begin,
+              uint64_t end)
+{
+    const struct search_config *config = search->config;
+    memset(pipe, 0, sizeof(*pipe));
+    pipe->search = search;
+
+    const unsigned num_digits = config->max_digits - config->min_digits + 1;
+    pipe->spans = malloc(num_digits * sizeof(*pipe->spans));
+    for (unsigned digits = config->max_digits;
+         digits >= config->min_digits; digits--) {
+        const uint64_t *offsets =
+            &search->unit_offsets[digits - config->min_digits];
+        const uint64_t first = MAX2(offsets[0], begin);
+        const uint64_t last = MIN2(offsets[1], end);
+        if (first >= last)
+            continue;
+
+        pipe->spans[pipe->num_spans++] = (struct pipeline_span) {
+            .pos = pipe->num_units,
+            .first = first,
+            .count = last - first,
+            .digits = digits,
+        };
+        pipe->num_units += last - first;
+    }
+
+    mpmc_queue_init(&pipe->full,
+                    search->num_threads * PIPELINE_BATCHES_PER_THREAD);
+    pipe->num_batches =
+        mpmc_queue_size(&pipe->full) + search->num_threads;
+    mpmc_queue_init(&pipe->free, pipe->num_batches);
+
+    pipe->batches = aligned_alloc(64, pipe->num_batches *
+                                      sizeof(*pipe->batches));
+    memset(pipe->batches, 0, pipe->num_batches * sizeof(*pipe->batches));
+    for (unsigned i = 0; i < pipe->num_batches; i++)
+        mpmc_queue_push(&pipe->free, &pipe->batches[i]);
+}
+
+static void
+pipeline_finish(struct pipeline *pipe)
+{
+    for (unsigned i = 0; i < pipe->num_batches; i++)
+        free(pipe->batches[i].survivors.cands);
+    free(pipe->batches);
+    mpmc_queue_finish(&pipe->full);
+    mpmc_queue_finish(&pipe->free);
+    free(pipe->spans);
+}
+
+/* Runs the rejection stage on the next unit which isn't done.  Returns
+ * NULL once every unit has been handed out.
+ */
+static struct pipeline_batch *
+pipeline_generate(struct pipeline *pipe, struct search_thread *thread)
+{
+    struct search *search = pipe->search;
+    const struct search_config *config = search->config;
+
+    const struct pipeline_span *span;
+    uint64_t index;
+    do {
+        const uint64_t pos =
+            __atomic_fetch_add(&pipe->next, 1, __ATOMIC_RELAXED);
+        if (pos >= pipe->num_units)
+            return NULL;
+
+        unsigned lo = 0, hi = pipe->num_spans - 1;
+        while (lo < hi) {
+            const unsigned mid = (lo + hi + 1) / 2;
+            if (pipe->spans[mid].pos <= pos)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        span = &pipe->spans[lo];
+        index = span->first + (pos - span->pos);
+    } while (unit_is_done(search, index));
+
+    /* The pop fails while the push at the head of the queue is only part
+     * done, so wait for whoever's pushing to finish
+     */
+    struct pipeline_batch *batch;
+    while ((batch = mpmc_queue_pop(&pipe->free)) == NULL)
+        sched_yield();
+
+    const uint64_t offset =
+        search->unit_offsets[span->digits - config->min_digits];
+    struct work_unit unit;
+    digits_get_unit(span->digits, index - offset, &unit);
+
+    memset(&batch->results, 0, sizeof(batch->results));
+    batch->survivors.len = 0;
+    batch->index = index;
+    batch->digits = span->digits;
+    batch->thread = thread_index();
+    reject_backend->reject_unit(config, thread, &unit, &batch->results,
+                                &batch->survivors);
+
+    /* The rejection stage's --all lines are in our buffer but it may be
+     * another thread which finishes the unit and lets it be checkpointed,
+     * same as in search_thread_finish_unit()
+     */
+    if (config->checkpoint_path && thread->out.len)
+        out_buf_flush(&thread->out, stdout);
+
+    return batch;
+}
+
+static void
+pipeline_evaluate(struct pipeline *pipe, struct search_thread *thread,
+                  struct pipeline_batch *batch)
+{
+    struct search *search = pipe->search;
+
+    search_survivors(search->config, thread, &batch->survivors,
+                     &batch->results);
+    search_thread_finish_unit(search, thread, batch->index, &batch->results);
+    persistence_stats_publish(&thread->live_stats, &thread->ws.stats);
+    search_progress(search, batch->digits, 1);
+
+    /* There's room for every batch */
+    mpmc_queue_push(&pipe->free, batch);
+
+    maybe_checkpoint(search);
+    maybe_report(search);
+}
+
+static void
+pipeline_run(struct pipeline *pipe, struct search_thread *thread)
+{
+    struct pipeline_stats stats = { 0, };
+
+    while (true) {
+        const bool generating =
+            __atomic_load_n(&pipe->next, __ATOMIC_RELAXED) < pipe->num_units;
+
+        if (!generating ||
+            mpmc_queue_len(&pipe->full) * 2 >= mpmc_queue_size(&pipe->full)) {
+            struct pipeline_batch *batch = mpmc_queue_pop(&pipe->full);
+            if (batch) {
+                const uint64_t start_ns = now_ns();
+                stats.handed_over += batch->thread != thread_index();
+                pipeline_evaluate(pipe, thread, batch);
+                stats.evaluate_ns += now_ns() - start_ns;
+                stats.batches++;
+                continue;
+            }
+
+            /* Whoever pushed a batch we didn't see pops it again after,
+             * so it's safe to leave once nothing's left to generate.
+             */
+            if (!generating)
+                break;
+        }
+
+        uint64_t start_ns = now_ns();
+        struct pipeline_batch *batch = pipeline_generate(pipe, thread);
+        stats.generate_ns += now_ns() - start_ns;
+        if (batch == NULL || mpmc_queue_push(&pipe->full, batch))
+            continue;
+
+        /* The queue is full so evaluating is the bottleneck */
+        start_ns = now_ns();
+        pipeline_evaluate(pipe, thread, batch);
+        stats.evaluate_ns += now_ns() - start_ns;
+        stats.batches++;
+    }
+
+    struct pipeline_stats *total = &pipe->search->pipeline;
+    __atomic_fetch_add(&total->generate_ns, stats.generate_ns,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->evaluate_ns, stats.evaluate_ns,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->batches, stats.batches, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->handed_over, stats.handed_over,
+                       __ATOMIC_RELAXED);
+}
+
+/* Searches every unit in [begin, end) which isn't already done, largest
+ * number of digits first.
+ */
+static void
+search_units(struct search *search, uint64_t begin, uint64_t end)
+{
+    const struct search_config *config = search->config;
+
+    struct pipeline pipe;
+    if (config->pipeline)
+        pipeline_init(&pipe, search, begin, end);
+
+#ifdef USE_OPENMP
+    #pragma omp parallel num_threads(search->num_threads)
+#endif
+    {
+        numa_bind_thread(thread_index());
+        struct search_thread *thread = &search->threads[thread_index()];
+        candidate_iter_init(&thread->iter, config->max_digits);
+        workspace_init(&thread->ws, config->max_digits);
+        mpz_init2(thread->num, digits_max_bits(config->max_digits));
+
+        if (config->pipeline) {
+            pipeline_run(&pipe, thread);
+        } else {
+            for (unsigned digits = config->max_digits;
+                 digits >= config->min_digits; digits--) {
+                const uint64_t *offsets =
+                    &search->unit_offsets[digits - config->min_digits];
+                const uint64_t first = MAX2(offsets[0], begin);
+                const uint64_t last = MIN2(offsets[1], end);
+
+                /* No barrier at the end so threads move straight on to
+                 * the next number of digits as soon as they run out of
+                 * units here.
+                 */
+#ifdef USE_OPENMP
+                #pragma omp for schedule(dynamic) nowait
+#endif
+                for (uint64_t u = first; u < last; u++) {
+                    if (unit_is_done(search, u))
+                        continue;
+
+                    struct work_unit unit;
+                    digits_get_unit(digits, u - offsets[0], &unit);
+
+                    struct persistence_results unit_results;
+                    memset(&unit_results, 0, sizeof(unit_results));
+                    search_unit(config, thread, &unit, &unit_results);
+                    search_thread_done_unit(search, thread, digits, u,
+                                            &unit_results);
+                }
+            }
+        }
+
+        candidate_iter_finish(&thread->iter);
+        workspace_finish(&thread->ws);
+        mpz_clear(thread->num);
+        free(thread->unit_hits.hits);
+        thread->unit_hits = (struct exps_hit_list) { NULL, };
+        out_buf_flush(&thread->out, stdout);
+        out_buf_finish(&thread->out);
+        free(thread->survivors.cands);
+        thread->survivors = (struct candidate_list) { NULL, };
+
+        /* Clear the live copy first so a report running concurrently
+         * undercounts rather than counts this thread twice.
+         */
+        const struct persistence_stats zero_stats = { 0, };
+        persistence_stats_publish(&thread->live_stats, &zero_stats);
+        persistence_stats_add(&search->stats, &thread->ws.stats);
+        __atomic_fetch_add(&search->node_candidates[thread_numa_node],
+                           thread->ws.stats.candidates, __ATOMIC_RELAXED);
+    }
+
+    if (config->pipeline)
+        pipeline_finish(&pipe);
+}
+
+/* Running a whole search from the options is only for the program */
+#ifndef PERSISTENCE_LIBRARY
+
+/* Prints how fast each NUMA node went if threads were pinned to them */
+static void
+search_report_numa(const struct search *search)
+{
+    if (!numa.enabled)
+        return;
+
+    const double elapsed = (now_ns() - search->start_ns) * 1e-9;
+    for (unsigned n = 0; n < numa.num_nodes; n++) {
+        unsigned num_threads = 0;
+        for (unsigned i = 0; i < search->num_threads; i++)
+            num_threads += numa_thread_node(i) == n;
+
+        const uint64_t candidates = search->node_candidates[n];
+        fprintf(stderr, "NUMA node %u: %u threads, %" PRIu64 " candidates "
+                "(%.3g/s)\n", numa.ids[n], num_threads, candidates,
+                elapsed > 0 ? candidates / elapsed : 0.0);
+    }
+}
+
+/* Prints how the threads split their time between the stages */
+static void
+search_report_pipeline(const struct search *search)
+{
+    const struct pipeline_stats *stats = &search->pipeline;
+    if (!search->config->pipeline || stats->batches == 0)
+        return;
+
+    const uint64_t total_ns = stats->generate_ns + stats->evaluate_ns;
+    fprintf(stderr, "Pipeline: %.1f%% generating, %.1f%% evaluating, "
+            "%" PRIu64 " of %" PRIu64 " batches handed over\n",
+            total_ns ? 100.0 * stats->generate_ns / total_ns : 0.0,
+            total_ns ? 100.0 * stats->evaluate_ns / total_ns : 0.0,
+            stats->handed_over, stats->batches);
+}
+
+static void
+print_cache_stats(const struct persistence_stats *stats)
+{
+    uint64_t lookups = stats->cache_hits + stats->cache_misses;
+    fprintf(stderr, "Persistence cache: %" PRIu64 " hits, %" PRIu64
+            " misses (%.1f%% hit rate)\n", stats->cache_hits,
+            stats->cache_misses,
+            lookups ? 100.0 * stats->cache_hits / lookups : 0.0);
+
+    if (product_store.map) {
+        fprintf(stderr, "Product store: %" PRIu64 " hits, %" PRIu64
+                " misses over %" PRIu64 " products\n", stats->store_hits,
+                stats->store_misses, product_store.num_entries);
+    }
+}
+
+static void
+search_report(const struct search_config *config,
+              struct persistence_results *results, struct exps_hit_list *hits,
+              struct persistence_stats *stats)
+{
+    if (config->exponent_search)
+        exponent_search_finish(hits, config->max_digits, results, stats);
+
+    if (config->verify)
+        verify_results(config, results);
+    results_print(results, config->min_persistence, &config->output);
+    print_cache_stats(stats);
+}
+
+static bool
+prune_init(const struct search_config *config)
+{
+    if (!config->prune)
+        return true;
+
+    return dead_set_init(config->max_digits, config->min_persistence,
+                         (size_t)config->prune_mb << 20, config->prune_path);
+}
+
+static void
+prune_finish(const struct search_config *config)
+{
+    if (config->prune_path && dead_set.bits)
+        dead_set_save(config->prune_path);
+    dead_set_finish();
+}
+
+/* Builds the tables and an empty census for each thread */
+static void
+search_census_init(struct search *search)
+{
+    census_tables_init(search->config->max_digits);
+    for (unsigned i = 0; i < search->num_threads; i++)
+        census_init(&search->threads[i].census);
+}
+
+/* Adds up the census of every thread, checks it and prints it */
+static bool
+search_census_report(struct search *search)
+{
+    struct census census;
+    census_init(&census);
+    census_add_unsearched(&census);
+    for (unsigned i = 0; i < search->num_threads; i++) {
+        census_merge(&census, &search->threads[i].census);
+        census_finish(&search->threads[i].census);
+    }
+
+    bool ok = census_check(&census);
+    if (ok)
+        census_print(&census, &search->config->output);
+
+    census_finish(&census);
+    census_tables_finish();
+    return ok;
+}
+
+static bool
+search_run(const struct search_config *config)
+{
+    if (!prune_init(config))
+        return false;
+
+    struct search search;
+    search_init(&search, config, max_threads());
+
+    if (config->resume && !read_checkpoint(&search)) {
+        search_finish(&search);
+        dead_set_finish();
+        return false;
+    }
+
+    if (config->census)
+        search_census_init(&search);
+
+    search_start(&search);
+    search_units(&search, 0, search.num_units);
+    search_print_found(&search);
+
+    struct persistence_results results;
+    struct exps_hit_list hits = { NULL, };
+    pthread_mutex_lock(&search.checkpoint_mtx);
+    if (config->checkpoint_path)
+        write_checkpoint(&search);
+    search_collect(&search, &results, &hits);
+    pthread_mutex_unlock(&search.checkpoint_mtx);
+
+    if (config->status_path)
+        search_report_status(&search);
+    search_report(config, &results, &hits, &search.stats);
+    search_report_numa(&search);
+    search_report_pipeline(&search);
+
+    bool ok = true;
+    if (config->census)
+        ok = search_census_report(&search);
+
+    free(hits.hits);
+    search_finish(&search);
+    prune_finish(config);
+
+    return ok;
+}
+
+/** Distributed search
+ *
+ * One process runs as a coordinator with --serve and any number of workers
+ * connect to it with --connect.  The coordinator owns the list of units
+ * and hands out leases on ranges of them; workers search their range with
+ * all their threads and send back the results.  The protocol is plain
+ * text, one request or reply per line:
+ *
+ *    worker                          coordinator
+ *    hello VERSION THREADS
+ *                                    config MIN MAX EXPS UNIT_CANDIDATES
+ *                                           PRUNE_BELOW
+ *    lease
+ *                                    lease ID BEGIN END | wait SECS |
+ *                                    finished
+ *    done ID
+ *    stats N <N counters>
+ *    <results as in a checkpoint>
+ *    end
+ *
+ * A lease which isn't finished within --lease-timeout seconds, or whose
+ * worker disconnects, goes back into the pool.  Results for a lease the
+ * coordinator has given up on are thrown away so nothing is counted twice.
+ * The coordinator writes the same checkpoints as a local search.
+ */
+#define NET_VERSION 5
+
+/* Leases are sized to take about this long */
+#define LEASE_TARGET_NS (30 * 1000000000ull)
+
+/* Workers with nothing to do wait this many seconds before asking again */
+#define LEASE_WAIT_SECS 5
+
+struct unit_range {
+    uint64_t begin;
+    uint64_t end;
+};
+
+struct net_conn {
+    int fd;
+
+    /* Data received but not yet handled */
+    char *buf;
+    size_t len;
+    size_t cap;
+    /* How far into a partial "done" message we've looked for its end */
+    size_t scanned;
+
+    bool said_hello;
+    unsigned threads;
+    /* Number of units to give this worker next time */
+    uint64_t lease_units;
+
+    bool has_lease;
+    uint64_t lease_id;
+    struct unit_range lease;
+    uint64_t lease_start_ns;
+    uint64_t lease_deadline_ns;
+};
+
+struct coordinator {
+    struct search *search;
+
+    struct net_conn *conns;
+    unsigned num_conns;
+    unsigned conns_cap;
+
+    /* Units above this index have all been handed out at least once */
+    uint64_t next_unit;
+    /* Leases which were given up on and need handing out again */
+    struct unit_range *returned;
+    size_t num_returned;
+    size_t returned_cap;
+
+    uint64_t units_done;
+    uint64_t next_lease_id;
+};
+
+/* Splits "[HOST:]PORT" into its parts.  The returned host is NULL if there
+ * isn't one and must be freed by the caller.
+ */
+static bool
+parse_address(const char *addr, char **host, const char **port)
+{
+    const char *colon = strrchr(addr, ':');
+    if (colon == NULL) {
+        *host = NULL;
+        *port = addr;
+    } else {
+        *host = strndup(addr, colon - addr);
+        *port = colon + 1;
+    }
+
+    return **port != '\0';
+}
+
+static int
+net_listen(const char *addr)
+{
+    char *host;
+    const char *port;
+    if (!parse_address(addr, &host, &port)) {
+        fprintf(stderr, "Invalid address %s\n", addr);
+        free(host);
+        return -1;
+    }
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_PASSIVE,
+    };
+    struct addrinfo *res;
+    int err = getaddrinfo(host, port, &hints, &res);
+    free(host);
+    if (err) {
+        fprintf(stderr, "Failed to resolve %s: %s\n", addr, gai_strerror(err));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(fd, 64) == 0)
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0)
+        fprintf(stderr, "Failed to listen on %s: %s\n", addr, strerror(errno));
+
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int
+net_connect(const char *addr)
+{
+    char *host;
+    const char *port;
+    if (!parse_address(addr, &host, &port) || host == NULL) {
+        fprintf(stderr, "Invalid address %s\n", addr);
+        free(host);
+        return -1;
+    }
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *res;
+    int err = getaddrinfo(host, port, &hints, &res);
+    free(host);
+    if (err) {
+        fprintf(stderr, "Failed to resolve %s: %s\n", addr, gai_strerror(err));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0)
+        fprintf(stderr, "Failed to connect to %s: %s\n", addr, strerror(errno));
+
+    freeaddrinfo(res);
+    return fd;
+}
+
+static bool
+net_conn_send(struct net_conn *conn, const char *fmt, ...)
+{
+    char msg[128];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+    assert(len > 0 && len < (int)sizeof(msg));
+
+    for (int sent = 0; sent < len;) {
+        ssize_t ret = write(conn->fd, msg + sent, len - sent);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        sent += ret;
+    }
+    return true;
+}
+
+static void
+coordinator_return_lease(struct coordinator *coord, struct net_conn *conn)
+{
+    if (!conn->has_lease)
+        return;
+
+    if (coord->num_returned == coord->returned_cap) {
+        coord->returned_cap = MAX2(coord->returned_cap * 2, 16);
+        coord->returned = realloc(coord->returned, coord->returned_cap *
+                                                   sizeof(*coord->returned));
+    }
+    coord->returned[coord->num_returned++] = conn->lease;
+    conn->has_lease = false;
+}
+
+/* Finds the next range of at most max_units units to hand out.  Returned
+ * leases go first, then fresh units from the top down so the biggest
+ * numbers are searched first, as in a local search.
+ */
+static bool
+coordinator_next_range(struct coordinator *coord, uint64_t max_units,
+                       struct unit_range *range)
+{
+    struct search *search = coord->search;
+
+    if (coord->num_returned) {
+        *range = coord->returned[--coord->num_returned];
+        return true;
+    }
+
+    /* Units may have been done already if we resumed from a checkpoint */
+    while (coord->next_unit > 0 && unit_is_done(search, coord->next_unit - 1))
+        coord->next_unit--;
+    if (coord->next_unit == 0)
+        return false;
+
+    range->end = coord->next_unit;
+    range->begin = range->end - 1;
+    while (range->begin > 0 && range->end - range->begin < max_units &&
+           !unit_is_done(search, range->begin - 1))
+        range->begin--;
+    coord->next_unit = range->begin;
+
+    return true;
+}
+
+static void
+coordinator_close(struct coordinator *coord, unsigned i)
+{
+    struct net_conn *conn = &coord->conns[i];
+
+    if (conn->has_lease) {
+        fprintf(stderr, "Worker disconnected, returning units %" PRIu64
+                "-%" PRIu64 "\n", conn->lease.begin, conn->lease.end);
+    }
+    coordinator_return_lease(coord, conn);
+
+    close(conn->fd);
+    free(conn->buf);
+    coord->conns[i] = coord->conns[--coord->num_conns];
+}
+
+static bool
+coordinator_handle_lease(struct coordinator *coord, struct net_conn *conn)
+{
+    if (coord->units_done == coord->search->num_units)
+        return net_conn_send(conn, "finished\n");
+
+    /* Workers only ask for one lease at a time */
+    if (conn->has_lease)
+        return false;
+
+    struct unit_range range;
+    if (!coordinator_next_range(coord, conn->lease_units, &range))
+        return net_conn_send(conn, "wait %u\n", LEASE_WAIT_SECS);
+
+    conn->has_lease = true;
+    conn->lease_id = coord->next_lease_id++;
+    conn->lease = range;
+    conn->lease_start_ns = now_ns();
+    conn->lease_deadline_ns = conn->lease_start_ns +
+        coord->search->config->lease_timeout * 1000000000ull;
+
+    return net_conn_send(conn, "lease %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+                         conn->lease_id, range.begin, range.end);
+}
+
+static bool
+coordinator_handle_done(struct coordinator *coord, struct net_conn *conn,
+                        const char *msg, size_t len)
+{
+    struct search *search = coord->search;
+
+    FILE *f = fmemopen((void *)msg, len, "r");
+    if (f == NULL)
+        return false;
+
+    uint64_t id;
+    struct persistence_stats stats;
+    struct persistence_results results;
+    memset(&results, 0, sizeof(results));
+    struct exps_hit_list hits = { NULL, };
+    bool ok = fscanf(f, "done %" SCNu64, &id) == 1 &&
+              read_stats(f, &stats) && read_results(f, &results, &hits);
+    fclose(f);
+
+    /* A lease which timed out may have been handed to someone else */
+    if (ok && conn->has_lease && conn->lease_id == id) {
+        const struct unit_range *lease = &conn->lease;
+
+        results_merge(&search->base_results, &results);
+        exps_hit_list_append_list(&search->base_hits, &hits);
+        persistence_stats_add(&search->stats, &stats);
+        for (uint64_t u = lease->begin; u < lease->end; u++) {
+            unit_set_done(search, u);
+            search_progress(search, unit_digits(search, u), 1);
+        }
+        coord->units_done += lease->end - lease->begin;
+        conn->has_lease = false;
+
+        /* Scale the next lease so it takes about LEASE_TARGET_NS */
+        uint64_t units = lease->end - lease->begin;
+        uint64_t elapsed = MAX2(now_ns() - conn->lease_start_ns, 1);
+        double scale = (double)LEASE_TARGET_NS / elapsed;
+        conn->lease_units = MAX2(MIN2(units * scale, units * 2.0), 1.0);
+    }
+
+    free(hits.hits);
+    return ok;
+}
+
+/* Handles every complete message in the connection's buffer.  Returns
+ * false if the connection should be dropped.
+ */
+static bool
+coordinator_handle_input(struct coordinator *coord, struct net_conn *conn)
+{
+    const struct search_config *config = coord->search->config;
+
+    size_t pos = 0;
+    while (pos < conn->len) {
+        char *msg = conn->buf + pos;
+        size_t avail = conn->len - pos;
+
+        char *nl = memchr(msg, '\n', avail);
+        if (nl == NULL)
+            break;
+
+        size_t len = nl + 1 - msg;
+        if (strncmp(msg, "done ", 5) == 0) {
+            /* The results run up to an "end" line */
+            len = 0;
+            char *line = MAX2(nl + 1, conn->buf + conn->scanned);
+            while (line < msg + avail) {
+                char *line_end = memchr(line, '\n', msg + avail - line);
+                if (line_end == NULL)
+                    break;
+                if (line_end - line == 3 && strncmp(line, "end", 3) == 0) {
+                    len = line_end + 1 - msg;
+                    break;
+                }
+                line = line_end + 1;
+            }
+            if (len == 0) {
+                conn->scanned = line - conn->buf;
+                break;
+            }
+
+            if (!conn->said_hello ||
+                !coordinator_handle_done(coord, conn, msg, len))
+                return false;
+        } else if (strncmp(msg, "hello ", 6) == 0) {
+            unsigned version, threads;
+            if (sscanf(msg, "hello %u %u", &version, &threads) != 2)
+                return false;
+            if (version != NET_VERSION) {
+                net_conn_send(conn, "error unsupported version %u\n", version);
+                return false;
+            }
+
+            conn->said_hello = true;
+            conn->threads = MAX2(threads, 1);
+            conn->lease_units = conn->threads * 4;
+            if (!net_conn_send(conn, "config %u %u %u %u %u\n",
+                               config->min_digits, config->max_digits,
+                               config->exponent_search, UNIT_CANDIDATES,
+                               search_config_prune_below(config)))
+                return false;
+        } else if (strncmp(msg, "lease\n", 6) == 0) {
+            if (!conn->said_hello || !coordinator_handle_lease(coord, conn))
+                return false;
+        } else {
+            return false;
+        }
+        pos += len;
+    }
+
+    memmove(conn->buf, conn->buf + pos, conn->len - pos);
+    conn->len -= pos;
+    conn->scanned = conn->scanned > pos ? conn->scanned - pos : 0;
+    return true;
+}
+
+static bool
+coordinator_read(struct coordinator *coord, struct net_conn *conn)
+{
+    if (conn->cap - conn->len < 4096) {
+        conn->cap = MAX2(conn->cap * 2, 8192);
+        conn->buf = realloc(conn->buf, conn->cap);
+    }
+
+    ssize_t ret = read(conn->fd, conn->buf + conn->len,
+                       conn->cap - conn->len);
+    if (ret < 0 && errno == EINTR)
+        return true;
+    if (ret <= 0)
+        return false;
+
+    conn->len += ret;
+    return coordinator_handle_input(coord, conn);
+}
+
+static void
+coordinator_accept(struct coordinator *coord, int listen_fd)
+{
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+        return;
+
+    if (coord->num_conns == coord->conns_cap) {
+        coord->conns_cap = MAX2(coord->conns_cap * 2, 16);
+        coord->conns = realloc(coord->conns, coord->conns_cap *
+                                             sizeof(*coord->conns));
+    }
+    coord->conns[coord->num_conns++] = (struct net_conn) { .fd = fd, };
+}
+
+static bool
+serve_run(const struct search_config *config)
+{
+    struct search search;
+    search_init(&search, config, 0);
+
+    if (config->resume && !read_checkpoint(&search)) {
+        search_finish(&search);
+        return false;
+    }
+
+    int listen_fd = net_listen(config->serve_addr);
+    if (listen_fd < 0) {
+        search_finish(&search);
+        return false;
+    }
+
+    struct coordinator coord = {
+        .search = &search,
+        .next_unit = search.num_units,
+    };
+    for (uint64_t u = 0; u < search.num_units; u++)
+        coord.units_done += unit_is_done(&search, u);
+
+    search_start(&search);
+
+    struct pollfd *fds = NULL;
+    while (coord.units_done < search.num_units) {
+        fds = realloc(fds, (coord.num_conns + 1) * sizeof(*fds));
+        fds[0] = (struct pollfd) { .fd = listen_fd, .events = POLLIN };
+        for (unsigned i = 0; i < coord.num_conns; i++)
+            fds[i + 1] = (struct pollfd) { .fd = coord.conns[i].fd,
+                                           .events = POLLIN };
+
+        if (poll(fds, coord.num_conns + 1, 1000) < 0 && errno != EINTR) {
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        /* Go backwards so closing a connection doesn't upset the mapping
+         * from fds to conns for ones we haven't looked at yet.
+         */
+        for (unsigned i = coord.num_conns; i-- > 0;) {
+            if ((fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) &&
+                !coordinator_read(&coord, &coord.conns[i]))
+                coordinator_close(&coord, i);
+        }
+        if (fds[0].revents & POLLIN)
+            coordinator_accept(&coord, listen_fd);
+
+        const uint64_t now = now_ns();
+        for (unsigned i = 0; i < coord.num_conns; i++) {
+            struct net_conn *conn = &coord.conns[i];
+            if (conn->has_lease && now >= conn->lease_deadline_ns) {
+                fprintf(stderr, "Lease on units %" PRIu64 "-%" PRIu64
+                        " timed out\n", conn->lease.begin, conn->lease.end);
+                coordinator_return_lease(&coord, conn);
+                conn->lease_units = MAX2(conn->lease_units / 2, 1);
+            }
+        }
+
+        if (config->checkpoint_path && now >= search.next_checkpoint_ns) {
+            write_checkpoint(&search);
+            search.next_checkpoint_ns =
+                now_ns() + config->checkpoint_interval * 1000000000ull;
+        }
+        maybe_report(&search);
+    }
+    free(fds);
+
+    /* Anyone still connected gets told we're done */
+    while (coord.num_conns) {
+        net_conn_send(&coord.conns[0], "finished\n");
+        coordinator_close(&coord, 0);
+    }
+    free(coord.conns);
+    free(coord.returned);
+    close(listen_fd);
+
+    const bool ok = coord.units_done == search.num_units;
+    if (ok) {
+        struct persistence_results results;
+        struct exps_hit_list hits = { NULL, };
+        if (config->checkpoint_path)
+            write_checkpoint(&search);
+        search_collect(&search, &results, &hits);
+
+        if (config->status_path)
+            search_report_status(&search);
+        search_report(config, &results, &hits, &search.stats);
+        free(hits.hits);
+    }
+
+    search_finish(&search);
+
+    return ok;
+}
+
+static bool
+worker_run(const struct search_config *config)
+{
+    int fd = net_connect(config->connect_addr);
+    if (fd < 0)
+        return false;
+
+    FILE *in = fdopen(fd, "r");
+    FILE *out = fdopen(dup(fd), "w");
+
+    const unsigned num_threads = max_threads();
+    fprintf(out, "hello %u %u\n", NET_VERSION, num_threads);
+    fflush(out);
+
+    /* The search itself is whatever the coordinator says it is */
+    struct search_config work_config = *config;
+    work_config.progress_interval = 0;
+    work_config.checkpoint_path = NULL;
+
+    unsigned exponent_search, unit_cands, prune_below;
+    if (fscanf(in, "config %u %u %u %u %u", &work_config.min_digits,
+               &work_config.max_digits, &exponent_search, &unit_cands,
+               &prune_below) != 5 ||
+        work_config.min_digits < 2 ||
+        work_config.max_digits < work_config.min_digits) {
+        fprintf(stderr, "Bad reply from coordinator %s\n",
+                config->connect_addr);
+        fclose(in);
+        fclose(out);
+        return false;
+    }
+    work_config.exponent_search = exponent_search;
+    work_config.prune = prune_below != 0;
+    if (work_config.prune)
+        work_config.min_persistence = prune_below;
+    if (unit_cands != UNIT_CANDIDATES) {
+        fprintf(stderr, "Coordinator uses %u candidates per unit, we use %u\n",
+                unit_cands, UNIT_CANDIDATES);
+        fclose(in);
+        fclose(out);
+        return false;
+    }
+
+    if (!prune_init(&work_config)) {
+        fclose(in);
+        fclose(out);
+        return false;
+    }
+
+    fprintf(stderr, "Searching %u-%u digits for %s\n", work_config.min_digits,
+            work_config.max_digits, config->connect_addr);
+
+    struct search search;
+    search_init(&search, &work_config, num_threads);
+    search_start(&search);
+
+    /* Counters as of the last lease we sent back */
+    struct persistence_stats sent_stats;
+    memset(&sent_stats, 0, sizeof(sent_stats));
+
+    bool ok = false;
+    while (true) {
+        fprintf(out, "lease\n");
+        fflush(out);
+
+        char reply[16];
+        if (fscanf(in, " %15s", reply) != 1)
+            break;
+
+        if (strcmp(reply, "finished") == 0) {
+            ok = true;
+            break;
+        } else if (strcmp(reply, "wait") == 0) {
+            unsigned secs;
+            if (fscanf(in, "%u", &secs) != 1)
+                break;
+            sleep(secs);
+            continue;
+        } else if (strcmp(reply, "lease") != 0) {
+            break;
+        }
+
+        uint64_t id, begin, end;
+        if (fscanf(in, "%" SCNu64 " %" SCNu64 " %" SCNu64, &id, &begin,
+                   &end) != 3 || begin >= end || end > search.num_units)
+            break;
+
+        search_units(&search, begin, end);
+        search_print_found(&search);
+
+        struct persistence_results results;
+        struct exps_hit_list hits = { NULL, };
+        pthread_mutex_lock(&search.checkpoint_mtx);
+        search_collect(&search, &results, &hits);
+        search_reset_results(&search);
+        pthread_mutex_unlock(&search.checkpoint_mtx);
+
+        struct persistence_stats stats = search.stats;
+        persistence_stats_sub(&stats, &sent_stats);
+        sent_stats = search.stats;
+
+        fprintf(out, "done %" PRIu64 "\n", id);
+        write_stats(out, &stats);
+        write_results(out, &results, &hits);
+        fprintf(out, "end\n");
+        free(hits.hits);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Lost connection to coordinator %s\n",
+                config->connect_addr);
+    }
+
+    print_cache_stats(&search.stats);
+    search_report_numa(&search);
+    search_report_pipeline(&search);
+
+    search_finish(&search);
+    prune_finish(&work_config);
+    fclose(in);
+    fclose(out);
+
+    return ok;
+}
+
+#endif /* PERSISTENCE_LIBRARY */
+
+/** Searches in other bases
+ *
+ * Everything above is written for base 10.  For other bases there's a
+ * generic search, from 2 to 36, which works out what it needs from the
+ * base when it starts.  It's nowhere near as fast but it's the same search.
+ *
+ * Persistence only depends on which digits a number has, so we walk
+ * multisets of digits, each written in ascending order to get the smallest
+ * number with those digits.  0s and 1s are left out as they are above.
+ * Two rules about pairs of digits a <= b cut down the rest:
+ *
+ *  - If a * b is a digit, writing that in place of a and b gives a
+ *    shorter number with the same product.
+ *
+ *  - If a * b = c * e for digits c < a, swapping them gives a smaller
+ *    number of the same length with the same product.
+ *
+ * For base 10 this leaves exactly the prefixes and the 5s, 7s, 8s and 9s
+ * from above.  Numbers whose product is a multiple of the base have a 0
+ * in it and are left out too.  Since the product only grows as we add
+ * digits, that cuts off everything below the point where it first happens.
+ *
+ * Work is split into units by fixing the counts of the first few digits,
+ * enough of them to have plenty of units for the threads.  Digits of
+ * products in a power-of-two base are sliced straight out of the limbs;
+ * anything else goes through mpn_get_str().
+ */
+#define MAX_BASE PERSISTENCE_MAX_BASE
+#define MAX_BASE_PRIMES 11
+
+struct base_info {
+    unsigned base;
+    /* log2 of the base if it's a power of two or 0 */
+    unsigned log2;
+    unsigned num_primes;
+    unsigned primes[MAX_BASE_PRIMES];
+    /* Factorisations of each digit and of the base.  A prime base isn't
+     * a product of digits so nothing is a multiple of it.
+     */
+    unsigned digit_exps[MAX_BASE][MAX_BASE_PRIMES];
+    unsigned base_exps[MAX_BASE_PRIMES];
+    bool base_prime;
+    /* Whether digits a and b can't both be in a candidate.  excludes[a][a]
+     * means there can be at most one a.
+     */
+    bool excludes[MAX_BASE][MAX_BASE];
+};
+
+static void
+base_info_init(struct base_info *info, unsigned base)
+{
+    memset(info, 0, sizeof(*info));
+    info->base = base;
+    if ((base & (base - 1)) == 0)
+        info->log2 = __builtin_ctz(base);
+
+    for (unsigned p = 2; p < base; p++) {
+        bool prime = true;
+        for (unsigned i = 0; i < info->num_primes; i++)
+            prime &= p % info->primes[i] != 0;
+        if (prime)
+            info->primes[info->num_primes++] = p;
+    }
+    assert(info->num_primes <= MAX_BASE_PRIMES);
+
+    unsigned rest = base;
+    for (unsigned i = 0; i < info->num_primes; i++) {
+        const unsigned p = info->primes[i];
+        for (unsigned d = 2; d < base; d++) {
+            for (unsigned n = d; n % p == 0; n /= p)
+                info->digit_exps[d][i]++;
+        }
+        for (; rest % p == 0; rest /= p)
+            info->base_exps[i]++;
+    }
+    info->base_prime = rest != 1;
+
+    for (unsigned a = 2; a < base; a++) {
+        for (unsigned b = a; b < base; b++) {
+            bool excluded = a * b < base;
+            for (unsigned c = 2; c < a && !excluded; c++)
+                excluded = (a * b) % c == 0 && (a * b) / c < base;
+            info->excludes[a][b] = info->excludes[b][a] = excluded;
+        }
+    }
+}
+
+/* Whether a number with the given product of digits is a multiple of the
+ * base
+ */
+static inline bool
+base_exps_divisible(const struct base_info *info,
+                    const unsigned exps[MAX_BASE_PRIMES])
+{
+    if (info->base_prime)
+        return false;
+
+    for (unsigned i = 0; i < info->num_primes; i++) {
+        if (exps[i] < info->base_exps[i])
+            return false;
+    }
+    return true;
+}
+
+struct base_candidate {
+    unsigned digits;
+    /* How many of each digit, 0s and 1s always being 0 */
+    unsigned count[MAX_BASE];
+};
+
+/* Compares two candidates by numeric value */
+static int
+base_candidate_cmp(const struct base_candidate *a,
+                   const struct base_candidate *b)
+{
+    if (a->digits != b->digits)
+        return a->digits < b->digits ? -1 : 1;
+
+    /* Same length and both in ascending order so the first digit they
+     * have a different number of decides it: more of it means it comes
+     * at a place where the other has something bigger.
+     */
+    for (unsigned d = 2; d < MAX_BASE; d++) {
+        if (a->count[d] != b->count[d])
+            return a->count[d] > b->count[d] ? -1 : 1;
+    }
+    return 0;
+}
+
+static void
+base_candidate_to_number(const struct base_info *info,
+                         const struct base_candidate *cand,
+                         struct persistence_number *num)
+{
+    memset(num, 0, sizeof(*num));
+    num->base = info->base;
+    num->digits = cand->digits;
+    memcpy(num->count, cand->count, sizeof(num->count));
+}
+
+struct base_results {
+    uint64_t count[MAX_PERSISTENCE];
+    struct base_candidate witness[MAX_PERSISTENCE];
+};
+
+static void
+base_results_add(struct base_results *results, unsigned persistence,
+                 uint64_t count, const struct base_candidate *cand)
+{
+    assert(persistence < MAX_PERSISTENCE);
+    if (results->count[persistence] == 0 ||
+        base_candidate_cmp(cand, &results->witness[persistence]) < 0)
+        results->witness[persistence] = *cand;
+    results->count[persistence] += count;
+}
+
+#ifndef PERSISTENCE_LIBRARY
+static const char base_digit_chars[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+
+static void
+out_base_candidate(struct out_buf *buf, const struct output_options *opts,
+                   const struct base_info *info,
+                   const struct base_candidate *cand)
+{
+    if (opts->format == OUTPUT_JSONL) {
+        out_buf_printf(buf, "\"base\": %u, \"digits\": %u, \"runs\": { ",
+                       info->base, cand->digits);
+        bool first = true;
+        for (unsigned d = 2; d < info->base; d++) {
+            out_buf_printf(buf, "%s\"%c\": %u", first ? "" : ", ",
+                           base_digit_chars[d], cand->count[d]);
+            first = false;
+        }
+        out_buf_printf(buf, " }");
+        if (!opts->expand)
+            return;
+        out_buf_printf(buf, ", \"number\": \"");
+    }
+
+    /* Digits which can only appear once are written out like the base 10
+     * prefixes, the rest as runs.
+     */
+    bool any = false, run = false;
+    for (unsigned d = 2; d < info->base; d++) {
+        if (cand->count[d] == 0)
+            continue;
+
+        if (opts->expand || info->excludes[d][d]) {
+            if (run)
+                out_buf_printf(buf, " ");
+            out_buf_fill(buf, base_digit_chars[d], cand->count[d]);
+            run = false;
+        } else {
+            out_buf_printf(buf, "%s%c^%u", any ? " " : "",
+                           base_digit_chars[d], cand->count[d]);
+            run = true;
+        }
+        any = true;
+    }
+
+    if (opts->format == OUTPUT_JSONL)
+        out_buf_printf(buf, "\"");
+}
+
+static void
+base_results_print(const struct base_results *results,
+                   const struct base_info *info, unsigned min_persistence,
+                   const struct output_options *opts)
+{
+    const bool json = opts->format == OUTPUT_JSONL;
+    struct out_buf buf = { NULL, };
+
+    for (unsigned p = min_persistence; p < MAX_PERSISTENCE; p++) {
+        if (results->count[p] == 0)
+            continue;
+
+        if (json) {
+            out_buf_printf(&buf, "{ \"type\": \"record\", \"persistence\": "
+                           "%u, ", p);
+            out_base_candidate(&buf, opts, info, &results->witness[p]);
+            out_buf_printf(&buf, " }\n");
+        } else {
+            out_buf_printf(&buf, "%02u:  ", p);
+            out_base_candidate(&buf, opts, info, &results->witness[p]);
+            out_buf_printf(&buf, "\n");
+        }
+    }
+
+    if (!json)
+        out_buf_printf(&buf, "\nCandidates by persistence:\n");
+    for (unsigned p = 0; p < MAX_PERSISTENCE; p++) {
+        if (results->count[p] == 0)
+            continue;
+
+        if (json) {
+            out_buf_printf(&buf, "{ \"type\": \"count\", \"base\": %u, "
+                           "\"persistence\": %u, \"count\": %" PRIu64 " }\n",
+                           info->base, p, results->count[p]);
+        } else {
+            out_buf_printf(&buf, "%02u:  %" PRIu64 "\n", p, results->count[p]);
+        }
+    }
+
+    out_buf_flush(&buf, stdout);
+    out_buf_finish(&buf);
+}
+#endif
+
+/* A candidate with the counts of the digits below digit fixed and left
+ * more digits to go
+ */
+struct base_unit {
+    struct base_candidate cand;
+    unsigned digit;
+    unsigned left;
+};
+
+struct base_unit_list {
+    struct base_unit *units;
+    size_t len;
+    size_t cap;
+};
+
+/* State of one thread walking candidates */
+struct base_walk {
+    const struct base_info *info;
+    const struct search_config *config;
+    struct base_candidate cand;
+
+    /* Product and factorisation of the digits below each digit */
+    mpz_t prods[MAX_BASE + 1];
+    unsigned exps[MAX_BASE + 1][MAX_BASE_PRIMES];
+
+    /* Set to collect units at split rather than walk past it */
+    struct base_unit_list *units;
+    unsigned split;
+
+    struct base_results results;
+    mpz_t num;
+    mpz_t pow;
+    unsigned char *str;
+    size_t str_cap;
+    mp_limb_t *limbs;
+    size_t limbs_cap;
+};
+
+static void
+base_walk_init(struct base_walk *w, const struct base_info *info,
+               const struct search_config *config)
+{
+    memset(w, 0, sizeof(*w));
+    w->info = info;
+    w->config = config;
+    for (unsigned i = 0; i <= MAX_BASE; i++)
+        mpz_init(w->prods[i]);
+    mpz_init(w->num);
+    mpz_init(w->pow);
+}
+
+static void
+base_walk_finish(struct base_walk *w)
+{
+    for (unsigned i = 0; i <= MAX_BASE; i++)
+        mpz_clear(w->prods[i]);
+    mpz_clear(w->num);
+    mpz_clear(w->pow);
+    free(w->str);
+    free(w->limbs);
+}
+
+/* Writes the digits of in to w->str, in no particular order, and returns
+ * how many there are
+ */
+static size_t
+base_digits(struct base_walk *w, const mpz_t in)
+{
+    const unsigned base = w->info->base;
+    const size_t max_len = mpz_sizeinbase(in, base) + 1;
+    if (max_len > w->str_cap) {
+        w->str_cap = MAX2(max_len, w->str_cap * 2);
+        w->str = realloc(w->str, w->str_cap);
+    }
+
+    const size_t n = mpz_size(in);
+    const mp_limb_t *limbs = mpz_limbs_read(in);
+
+    if (w->info->log2) {
+        const unsigned bits = w->info->log2;
+        const mp_limb_t mask = base - 1;
+        const size_t len = DIV_ROUND_UP(mpz_sizeinbase(in, 2), bits);
+        for (size_t i = 0; i < len; i++) {
+            const size_t bit = i * bits;
+            const size_t limb = bit / GMP_NUMB_BITS;
+            const unsigned shift = bit % GMP_NUMB_BITS;
+            mp_limb_t v = limbs[limb] >> shift;
+            if (shift + bits > GMP_NUMB_BITS && limb + 1 < n)
+                v |= limbs[limb + 1] << (GMP_NUMB_BITS - shift);
+            w->str[i] = v & mask;
+        }
+        return len;
+    }
+
+    /* mpn_get_str() destroys its input and may leave leading zeros */
+    if (n + 1 > w->limbs_cap) {
+        w->limbs_cap = MAX2(n + 1, w->limbs_cap * 2);
+        w->limbs = realloc(w->limbs, w->limbs_cap * sizeof(*w->limbs));
+    }
+    memcpy(w->limbs, limbs, n * sizeof(*limbs));
+    size_t len = mpn_get_str(w->str, base, w->limbs, n), skip = 0;
+    while (skip + 1 < len && w->str[skip] == 0)
+        skip++;
+    memmove(w->str, w->str + skip, len - skip);
+    return len - skip;
+}
+
+/* Returns the number of steps it takes to get in down to a single digit.
+ * Destroys in.
+ */
+static unsigned
+base_persistence(struct base_walk *w, mpz_t in)
+{
+    const struct base_info *info = w->info;
+
+    unsigned count = 0;
+    while (mpz_cmp_ui(in, info->base) >= 0) {
+        count++;
+
+        unsigned hist[MAX_BASE] = { 0, };
+        const size_t len = base_digits(w, in);
+        for (size_t i = 0; i < len; i++)
+            hist[w->str[i]]++;
+        if (hist[0])
+            break;
+
+        mpz_set_ui(in, 1);
+        for (unsigned i = 0; i < info->num_primes; i++) {
+            unsigned exp = 0;
+            for (unsigned d = 2; d < info->base; d++)
+                exp += hist[d] * info->digit_exps[d][i];
+            if (exp) {
+                mpz_ui_pow_ui(w->pow, info->primes[i], exp);
+                mpz_mul(in, in, w->pow);
+            }
+        }
+    }
+
+    return count;
+}
+
+static void
+base_unit_list_append(struct base_unit_list *list, const struct base_unit *unit)
+{
+    if (list->len == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 64;
+        list->units = realloc(list->units, list->cap * sizeof(*list->units));
+    }
+    list->units[list->len++] = *unit;
+}
+
+/* Walks every candidate with the counts of the digits below digit fixed
+ * and left more digits, given the product and factorisation of those in
+ * prods[digit] and exps[digit].
+ */
+static void
+base_walk(struct base_walk *w, unsigned digit, unsigned left)
+{
+    const struct base_info *info = w->info;
+    struct base_candidate *cand = &w->cand;
+
+    if (w->units && (digit == w->split || left == 0)) {
+        const struct base_unit unit = { *cand, digit, left };
+        base_unit_list_append(w->units, &unit);
+        return;
+    }
+
+    if (left == 0) {
+        mpz_set(w->num, w->prods[digit]);
+        const unsigned persistence = 1 + base_persistence(w, w->num);
+        base_results_add(&w->results, persistence, 1, cand);
+        if (w->config->found &&
+            persistence >= w->config->min_persistence) {
+            struct persistence_number num;
+            base_candidate_to_number(info, cand, &num);
+            w->config->found(w->config->found_data, persistence, &num);
+        }
+        return;
+    }
+
+    if (digit == info->base)
+        return;
+
+    unsigned max = left;
+    for (unsigned d = 2; d < digit; d++) {
+        if (cand->count[d] && info->excludes[d][digit])
+            max = 0;
+    }
+    if (info->excludes[digit][digit])
+        max = MIN2(max, 1);
+
+    /* The last digit has to take up whatever is left */
+    const unsigned min = digit == info->base - 1 ? left : 0;
+    if (max < min)
+        return;
+
+    unsigned *exps = w->exps[digit + 1];
+    memcpy(exps, w->exps[digit], sizeof(w->exps[digit]));
+    if (!w->units)
+        mpz_set(w->prods[digit + 1], w->prods[digit]);
+
+    for (unsigned c = 0; c <= max; c++) {
+        if (c > 0) {
+            for (unsigned i = 0; i < info->num_primes; i++)
+                exps[i] += info->digit_exps[digit][i];
+            if (base_exps_divisible(info, exps))
+                break;
+            if (!w->units)
+                mpz_mul_ui(w->prods[digit + 1], w->prods[digit + 1], digit);
+        }
+        if (c < min)
+            continue;
+
+        cand->count[digit] = c;
+        base_walk(w, digit + 1, left - c);
+    }
+    cand->count[digit] = 0;
+}
+
+/* Sets out to the product of the digits of cand, clobbering tmp */
+static void
+base_candidate_product(mpz_t out, const struct base_candidate *cand,
+                       mpz_t tmp)
+{
+    mpz_set_ui(out, 1);
+    for (unsigned d = 2; d < MAX_BASE; d++) {
+        if (cand->count[d] == 0)
+            continue;
+
+        mpz_ui_pow_ui(tmp, d, cand->count[d]);
+        mpz_mul(out, out, tmp);
+    }
+}
+
+/* Picks up the walk where unit left off */
+static void
+base_walk_unit(struct base_walk *w, const struct base_unit *unit)
+{
+    const struct base_info *info = w->info;
+
+    w->cand = unit->cand;
+    base_candidate_product(w->prods[unit->digit], &unit->cand, w->pow);
+    memset(w->exps[unit->digit], 0, sizeof(w->exps[unit->digit]));
+    for (unsigned d = 2; d < unit->digit; d++) {
+        for (unsigned i = 0; i < info->num_primes; i++)
+            w->exps[unit->digit][i] += unit->cand.count[d] *
+                                       info->digit_exps[d][i];
+    }
+
+    base_walk(w, unit->digit, unit->left);
+}
+
+/* Splits the candidates with the given number of digits into units, fixing
+ * the counts of as few digits as gives at least min_units of them.
+ */
+static void
+base_split_digits(struct base_walk *w, unsigned digits, size_t min_units,
+                  struct base_unit_list *units)
+{
+    const size_t start = units->len;
+    w->units = units;
+    for (w->split = 2; ; w->split++) {
+        units->len = start;
+        memset(&w->cand, 0, sizeof(w->cand));
+        w->cand.digits = digits;
+        memset(w->exps[2], 0, sizeof(w->exps[2]));
+        base_walk(w, 2, digits);
+        if (units->len - start >= min_units || w->split > w->info->base)
+            break;
+    }
+    w->units = NULL;
+}
+
+/* Everything a search in another base needs, built once up front */
+struct base_search {
+    struct base_info info;
+    unsigned num_threads;
+    struct base_walk *walks;
+    /* Units of every number of digits, the biggest first as with base 10 */
+    struct base_unit_list units;
+};
+
+static void
+base_search_init(struct base_search *bs, const struct search_config *config,
+                 unsigned num_threads)
+{
+    base_info_init(&bs->info, config->base);
+    bs->num_threads = num_threads;
+    bs->walks = calloc(num_threads, sizeof(*bs->walks));
+    for (unsigned i = 0; i < num_threads; i++)
+        base_walk_init(&bs->walks[i], &bs->info, config);
+
+    bs->units = (struct base_unit_list) { NULL, };
+    for (unsigned d = config->max_digits; d >= config->min_digits; d--)
+        base_split_digits(&bs->walks[0], d, 64 * num_threads, &bs->units);
+}
+
+static void
+base_search_finish(struct base_search *bs)
+{
+    for (unsigned i = 0; i < bs->num_threads; i++)
+        base_walk_finish(&bs->walks[i]);
+    free(bs->walks);
+    free(bs->units.units);
+}
+
+/* Walks units [begin, end) and adds what they have to results */
+static void
+base_search_units(struct base_search *bs, uint64_t begin, uint64_t end,
+                  struct base_results *results)
+{
+    for (unsigned i = 0; i < bs->num_threads; i++)
+        memset(&bs->walks[i].results, 0, sizeof(bs->walks[i].results));
+
+#ifdef USE_OPENMP
+    #pragma omp parallel for schedule(dynamic) num_threads(bs->num_threads)
+#endif
+    for (uint64_t i = begin; i < end; i++)
+        base_walk_unit(&bs->walks[thread_index()], &bs->units.units[i]);
+
+    for (unsigned i = 0; i < bs->num_threads; i++) {
+        const struct base_results *src = &bs->walks[i].results;
+        for (unsigned p = 0; p < MAX_PERSISTENCE; p++) {
+            if (src->count[p])
+                base_results_add(results, p, src->count[p], &src->witness[p]);
+        }
+    }
+}
+
+#ifndef PERSISTENCE_LIBRARY
+static bool
+base_search_run(const struct search_config *config)
+{
+    struct base_search bs;
+    base_search_init(&bs, config, max_threads());
+
+    struct base_results results;
+    memset(&results, 0, sizeof(results));
+    base_search_units(&bs, 0, bs.units.len, &results);
+    base_results_print(&results, &bs.info, config->min_persistence,
+                       &config->output);
+
+    base_search_finish(&bs);
+    return true;
+}
+#endif
+
+/** Library interface
+ *
+ * The entry points declared in persistence.h.  A context is a search
+ * config plus whatever is worth keeping between calls.  For base 10 that's
+ * a search, which carries its threads, and a workspace for
+ * persistence_of(); for other bases it's the list of units.  The tables
+ * of powers and the cache are process-wide and stay up for as long as any
+ * context does.  Searches go through the same code as the program does,
+ * with progress and status output turned off.
+ */
+struct persistence_ctx {
+    struct search_config config;
+    unsigned num_threads;
+
+    /* Base 10 only */
+    struct search search;
+    struct workspace ws;
+    /* Other bases only */
+    struct base_search base_search;
+
+    mpz_t num;
+
+    /* Passed on by ctx_found() one call at a time */
+    pthread_mutex_t found_mtx;
+    persistence_found_fn found;
+    void *found_data;
+};
+
+struct persistence_iter {
+    struct persistence_ctx *ctx;
+    uint64_t next_unit;
+    uint64_t end_unit;
+    /* Whether a unit has been started */
+    bool started;
+
+    /* Base 10 only */
+    struct candidate_iter iter;
+    /* Other bases only: the candidates of the unit being walked */
+    struct base_walk walk;
+    struct base_unit_list cands;
+    size_t next_cand;
+};
+
+static unsigned num_contexts;
+/* Whether the cache is ours to free along with the last context */
+static bool own_persistence_cache;
+
+static void
+ctx_found(void *data, unsigned persistence,
+          const struct persistence_number *num)
+{
+    struct persistence_ctx *ctx = data;
+    pthread_mutex_lock(&ctx->found_mtx);
+    ctx->found(ctx->found_data, persistence, num);
+    pthread_mutex_unlock(&ctx->found_mtx);
+}
+
+static int
+number_cmp(const struct persistence_number *a,
+           const struct persistence_number *b)
+{
+    if (a->digits != b->digits)
+        return a->digits < b->digits ? -1 : 1;
+
+    /* Same as base_candidate_cmp() */
+    for (unsigned d = 0; d < PERSISTENCE_MAX_BASE; d++) {
+        if (a->count[d] != b->count[d])
+            return a->count[d] > b->count[d] ? -1 : 1;
+    }
+    return 0;
+}
+
+static void
+summary_add(struct persistence_summary *summary, unsigned persistence,
+            uint64_t count, const struct persistence_number *num)
+{
+    if (summary->count[persistence] == 0 ||
+        number_cmp(num, &summary->smallest[persistence]) < 0)
+        summary->smallest[persistence] = *num;
+    summary->count[persistence] += count;
+}
+
+void
+persistence_options_init(struct persistence_options *opts)
+{
+    *opts = (struct persistence_options) {
+        .threads = 0,
+        .min_digits = 2,
+        .max_digits = MAX_DIGITS,
+        .base = 10,
+        .min_persistence = 3,
+        .power_table_mb = 256,
+    };
+}
+
+struct persistence_ctx *
+persistence_ctx_create(const struct persistence_options *opts)
+{
+    /* Whoever embeds us decides what to tell the user */
+    if (opts->base < 2 || opts->base > MAX_BASE ||
+        opts->min_digits < 2 || opts->max_digits < opts->min_digits) {
+        errno = EINVAL;
+        return NULL;
+    }
+#ifndef USE_OPENMP
+    if (opts->threads > 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+#endif
+
+    /* The search results inside want the same alignment as threads */
+    struct persistence_ctx *ctx = aligned_alloc(64, sizeof(*ctx));
+    if (!ctx)
+        return NULL;
+    memset(ctx, 0, sizeof(*ctx));
+
+    if (num_contexts++ == 0) {
+        select_digit_kernel();
+        select_reject_backend(NULL);
+        if (!persistence_cache) {
+            persistence_cache = calloc(1ull << CACHE_BITS,
+                                       sizeof(*persistence_cache));
+            own_persistence_cache = true;
+        }
+    }
+
+    ctx->num_threads = opts->threads ? opts->threads : max_threads();
+    ctx->config = (struct search_config) {
+        .min_digits = opts->min_digits,
+        .max_digits = opts->max_digits,
+        .threads = ctx->num_threads,
+        .min_persistence = opts->min_persistence,
+        .checkpoint_interval = 300,
+        .lease_timeout = 600,
+        .power_table_mb = opts->power_table_mb,
+        .prune_mb = 64,
+        .output = { .format = OUTPUT_TEXT, },
+        .base = opts->base,
+    };
+
+    if (ctx->config.base == 10) {
+        search_init(&ctx->search, &ctx->config, ctx->num_threads);
+        workspace_init(&ctx->ws, ctx->config.max_digits);
+    } else {
+        base_search_init(&ctx->base_search, &ctx->config, ctx->num_threads);
+    }
+    mpz_init(ctx->num);
+    pthread_mutex_init(&ctx->found_mtx, NULL);
+
+    return ctx;
+}
+
+void
+persistence_ctx_destroy(struct persistence_ctx *ctx)
+{
+    if (ctx->config.base == 10) {
+        search_finish(&ctx->search);
+        workspace_finish(&ctx->ws);
+    } else {
+        base_search_finish(&ctx->base_search);
+    }
+    mpz_clear(ctx->num);
+    pthread_mutex_destroy(&ctx->found_mtx);
+    free(ctx);
+
+    if (--num_contexts == 0 && own_persistence_cache) {
+        free(persistence_cache);
+        persistence_cache = NULL;
+        own_persistence_cache = false;
+    }
+}
+
+unsigned
+persistence_of(struct persistence_ctx *ctx, const mpz_t n)
+{
+    mpz_abs(ctx->num, n);
+    if (ctx->config.base != 10)
+        return base_persistence(&ctx->base_search.walks[0], ctx->num);
+
+    bool zero;
+    return mpz_persistence(ctx->num, &ctx->ws, &zero);
+}
+
+uint64_t
+persistence_num_units(const struct persistence_ctx *ctx)
+{
+    if (ctx->config.base != 10)
+        return ctx->base_search.units.len;
+    return ctx->search.num_units;
+}
+
+bool
+persistence_search(struct persistence_ctx *ctx, uint64_t begin,
+                   uint64_t end, persistence_found_fn found, void *data,
+                   struct persistence_summary *summary)
+{
+    if (begin > end || end > persistence_num_units(ctx))
+        return false;
+
+    ctx->found = found;
+    ctx->found_data = data;
+    ctx->config.found = found ? ctx_found : NULL;
+    ctx->config.found_data = ctx;
+
+    struct persistence_number num;
+    if (ctx->config.base == 10) {
+        struct search *search = &ctx->search;
+        search_reset_results(search);
+        search_start(search);
+        search_units(search, begin, end);
+
+        struct persistence_results results;
+        struct exps_hit_list hits = { NULL, };
+        pthread_mutex_lock(&search->checkpoint_mtx);
+        search_collect(search, &results, &hits);
+        pthread_mutex_unlock(&search->checkpoint_mtx);
+        free(hits.hits);
+
+        for (unsigned p = 0; p < MAX_PERSISTENCE; p++) {
+            if (results.count[p] == 0)
+                continue;
+            candidate_to_number(&results.witness[p], &num);
+            summary_add(summary, p, results.count[p], &num);
+        }
+    } else {
+        struct base_results results;
+        memset(&results, 0, sizeof(results));
+        base_search_units(&ctx->base_search, begin, end, &results);
+
+        for (unsigned p = 0; p < MAX_PERSISTENCE; p++) {
+            if (results.count[p] == 0)
+                continue;
+            base_candidate_to_number(&ctx->base_search.info,
+                                     &results.witness[p], &num);
+            summary_add(summary, p, results.count[p], &num);
+        }
+    }
+
+    ctx->config.found = NULL;
+    return true;
+}
+
+struct persistence_iter *
+persistence_iter_create(struct persistence_ctx *ctx, uint64_t begin,
+                        uint64_t end)
+{
+    if (begin > end || end > persistence_num_units(ctx))
+        return NULL;
+
+    struct persistence_iter *it = calloc(1, sizeof(*it));
+    it->ctx = ctx;
+    it->next_unit = begin;
+    it->end_unit = end;
+    if (ctx->config.base == 10) {
+        candidate_iter_init(&it->iter, ctx->config.max_digits);
+    } else {
+        base_walk_init(&it->walk, &ctx->base_search.info, &ctx->config);
+        it->walk.units = &it->cands;
+        it->walk.split = ctx->base_search.info.base + 1;
+    }
+    return it;
+}
+
+bool
+persistence_iter_next(struct persistence_iter *it,
+                      struct persistence_number *num, mpz_ptr product)
+{
+    const struct persistence_ctx *ctx = it->ctx;
+
+    while (true) {
+        if (it->started && ctx->config.base == 10 &&
+            candidate_iter_next(&it->iter)) {
+            candidate_to_number(&it->iter.cand, num);
+            if (product)
+                mpz_set(product, it->iter.num);
+            return true;
+        }
+        if (it->started && ctx->config.base != 10 &&
+            it->next_cand < it->cands.len) {
+            const struct base_candidate *cand =
+                &it->cands.units[it->next_cand++].cand;
+            base_candidate_to_number(&ctx->base_search.info, cand, num);
+            if (product)
+                base_candidate_product(product, cand, it->walk.pow);
+            return true;
+        }
+
+        if (it->next_unit >= it->end_unit)
+            return false;
+
+        const uint64_t index = it->next_unit++;
+        if (ctx->config.base == 10) {
+            const unsigned digits = unit_digits(&ctx->search, index);
+            const uint64_t first =
+                ctx->search.unit_offsets[digits - ctx->config.min_digits];
+            struct work_unit unit;
+            digits_get_unit(digits, index - first, &unit);
+            candidate_iter_start(&it->iter, unit.prefix, unit.digits,
+                                 unit.row_begin, unit.row_end);
+        } else {
+            /* With the split past the last digit, the walk hands back
+             * every candidate of the unit as a unit of its own.
+             */
+            it->cands.len = 0;
+            it->next_cand = 0;
+            base_walk_unit(&it->walk, &ctx->base_search.units.units[index]);
+        }
+        it->started = true;
+    }
+}
+
+void
+persistence_iter_destroy(struct persistence_iter *it)
+{
+    if (it->ctx->config.base == 10) {
+        candidate_iter_finish(&it->iter);
+    } else {
+        base_walk_finish(&it->walk);
+        free(it->cands.units);
+    }
+    free(it);
+}
+
+void
+persistence_number_get_mpz(mpz_t out, const struct persistence_number *num)
+{
+    mpz_set_ui(out, 0);
+    for (unsigned d = 0; d < num->base; d++) {
+        for (unsigned i = 0; i < num->count[d]; i++) {
+            mpz_mul_ui(out, out, num->base);
+            mpz_add_ui(out, out, d);
+        }
+    }
+}
+
+/* The library is built from this file too, without the program */
+#ifndef PERSISTENCE_LIBRARY
+
+/** Benchmarks
+ *
+ * --bench times the kernels on fixed inputs and prints the results as JSON
+ * so that runs can be compared by a script.  There are two kinds of input:
+ * pseudo-random 2^a * 3^b * 5^c * 7^d numbers, which look like the
+ * products the search actually sees, and numbers from the family of the
+ * record holder 277777788888899, which have no zeros and so never get to
+ * bail out early.  GMP's allocator is hooked to count allocations.
+ */
+#define BENCH_NUM_INPUTS 16
+#define BENCH_MIN_ITERS 16
+#define BENCH_MIN_NS 200000000ull
+#define BENCH_MAX_DIGITS 100000
+
+static const unsigned bench_digits[] = { 10, 100, 1000, 10000, 100000 };
+#define NUM_BENCH_DIGITS (sizeof(bench_digits) / sizeof(bench_digits[0]))
+
+static uint64_t bench_allocs;
+
+static void *
+bench_alloc(size_t size)
+{
+    bench_allocs++;
+    return malloc(size);
+}
+
+static void *
+bench_realloc(void *ptr, size_t old_size, size_t new_size)
+{
+    (void)old_size;
+    bench_allocs++;
+    return realloc(ptr, new_size);
+}
+
+static void
+bench_free(void *ptr, size_t size)
+{
+    (void)size;
+    free(ptr);
+}
+
+/* splitmix64, so the inputs are the same on every run and platform */
+static uint64_t
+bench_rand(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+/* A pseudo-random 2^a * 3^b * 5^c * 7^d with about the given number of
+ * digits
+ */
+static void
+bench_smooth_input(mpz_t out, unsigned digits, uint64_t *state,
+                   struct workspace *ws)
+{
+    static const double log10_primes[NUM_PRIMES] = {
+        0.30103, 0.47712, 0.69897, 0.84510,
+    };
+
+    unsigned weights[NUM_PRIMES];
+    double total = 0;
+    for (unsigned i = 0; i < NUM_PRIMES; i++) {
+        weights[i] = 1 + bench_rand(state) % 64;
+        total += weights[i] * log10_primes[i];
+    }
+
+    unsigned exps[NUM_PRIMES];
+    for (unsigned i = 0; i < NUM_PRIMES; i++)
+        exps[i] = digits * weights[i] / total;
+
+    exps_to_mpz(out, exps, ws);
+}
+
+/* 2 followed by 7s, 8s and 9s in the same proportions as 277777788888899 */
+static void
+bench_record_input(mpz_t out, unsigned digits)
+{
+    char *str = malloc(digits + 1);
+    unsigned num7s = (digits - 1) * 6 / 14;
+    unsigned num8s = (digits - 1) * 6 / 14;
+    unsigned num9s = digits - 1 - num7s - num8s;
+
+    char *c = str;
+    *c++ = '2';
+    memset(c, '7', num7s);
+    memset(c + num7s, '8', num8s);
+    memset(c + num7s + num8s, '9', num9s);
+    str[digits] = '\0';
+
+    mpz_set_str(out, str, 10);
+    free(str);
+}
+
+struct bench_result {
+    uint64_t iters;
+    uint64_t ns;
+    uint64_t allocs;
+    double digits;
+};
+
+static void
+bench_print(const char *name, const char *input, unsigned digits,
+            const struct bench_result *res, bool *first)
+{
+    double ns = (double)res->ns / res->iters;
+    printf("%s    { \"name\": \"%s\", \"input\": \"%s\", \"digits\": %u, "
+           "\"iterations\": %" PRIu64 ", \"ns_per_candidate\": %.1f, "
+           "\"digits_per_sec\": %.4g, \"allocs_per_candidate\": %.3f }",
+           *first ? "" : ",\n", name, input, digits, res->iters, ns,
+           res->digits * 1e9 / ns, (double)res->allocs / res->iters);
+    fflush(stdout);
+    *first = false;
+}
+
+/* Runs digit_exps() or mpz_persistence() over a set of inputs */
+static void
+bench_kernel(bool persistence, mpz_t inputs[BENCH_NUM_INPUTS],
+             struct workspace *ws, struct bench_result *res)
+{
+    mpz_t num;
+    mpz_init2(num, digits_max_bits(BENCH_MAX_DIGITS));
+
+    res->digits = 0;
+    for (unsigned i = 0; i < BENCH_NUM_INPUTS; i++)
+        res->digits += mpz_sizeinbase(inputs[i], 10);
+    res->digits /= BENCH_NUM_INPUTS;
+
+    /* Warm up so the power tables and scratch space are filled in */
+    bool zero;
+    for (unsigned i = 0; i < BENCH_NUM_INPUTS; i++) {
+        unsigned exps[NUM_PRIMES];
+        mpz_set(num, inputs[i]);
+        if (persistence)
+            mpz_persistence(num, ws, &zero);
+        else
+            digit_exps(exps, num, ws);
+    }
+
+    const uint64_t allocs = bench_allocs;
+    const uint64_t start = now_ns();
+    uint64_t iters = 0, ns = 0;
+    do {
+        for (unsigned i = 0; i < BENCH_NUM_INPUTS; i++) {
+            unsigned exps[NUM_PRIMES];
+            mpz_set(num, inputs[i]);
+            if (persistence)
+                mpz_persistence(num, ws, &zero);
+            else
+                digit_exps(exps, num, ws);
+        }
+        iters += BENCH_NUM_INPUTS;
+        ns = now_ns() - start;
+    } while (iters < BENCH_MIN_ITERS || ns < BENCH_MIN_NS);
+
+    res->iters = iters;
+    res->ns = ns;
+    res->allocs = bench_allocs - allocs;
+
+    mpz_clear(num);
+}
+
+/* Steps the candidate generator through as many candidates as it can */
+static void
+bench_generator(unsigned digits, struct bench_result *res)
+{
+    const struct prefix *prefix = &prefixes[1];
+    const unsigned num_rows = candidate_num_rows(prefix, digits);
+
+    struct candidate_iter iter;
+    candidate_iter_init(&iter, digits);
+
+    const uint64_t allocs = bench_allocs;
+    const uint64_t start = now_ns();
+    uint64_t iters = 0, ns = 0;
+    unsigned row = 0;
+    do {
+        /* A row at a time so we get a mix of steps within and between
+         * rows even when there isn't time for all of them.
+         */
+        candidate_iter_start(&iter, prefix, digits, row,
+                             MIN2(row + 2, num_rows));
+        while (candidate_iter_next(&iter))
+            iters++;
+        row = row + 2 < num_rows ? row + 2 : 0;
+        ns = now_ns() - start;
+    } while (iters < BENCH_MIN_ITERS || ns < BENCH_MIN_NS);
+
+    res->iters = iters;
+    res->ns = ns;
+    res->allocs = bench_allocs - allocs;
+    res->digits = digits;
+
+    candidate_iter_finish(&iter);
+}
+
+static bool
+bench_run(const struct search_config *config)
+{
+    mp_set_memory_functions(bench_alloc, bench_realloc, bench_free);
+
+    /* Cache hits would just measure the cache */
+    uint64_t *cache = persistence_cache;
+    persistence_cache = NULL;
+
+    power_tables_init(BENCH_MAX_DIGITS, (size_t)config->power_table_mb << 20);
+
+    struct workspace ws;
+    workspace_init(&ws, BENCH_MAX_DIGITS);
+
+    mpz_t inputs[BENCH_NUM_INPUTS];
+    for (unsigned i = 0; i < BENCH_NUM_INPUTS; i++)
+        mpz_init(inputs[i]);
+
+    printf("{\n  \"digit_kernel\": \"%s\",\n  \"benchmarks\": [\n",
+           digit_kernel->name);
+
+    bool first = true;
+    for (unsigned d = 0; d < NUM_BENCH_DIGITS; d++) {
+        const unsigned digits = bench_digits[d];
+        struct bench_result res;
+
+        uint64_t state = digits;
+        for (unsigned i = 0; i < BENCH_NUM_INPUTS; i++)
+            bench_smooth_input(inputs[i], digits, &state, &ws);
+
+        bench_kernel(false, inputs, &ws, &res);
+        bench_print("digit_exps", "smooth", digits, &res, &first);
+        bench_kernel(true, inputs, &ws, &res);
+        bench_print("persistence", "smooth", digits, &res, &first);
+
+        for (unsigned i = 0; i < BENCH_NUM_INPUTS; i++)
+            bench_record_input(inputs[i], digits);
+
+        bench_kernel(false, inputs, &ws, &res);
+        bench_print("digit_exps", "record", digits, &res, &first);
+        bench_kernel(true, inputs, &ws, &res);
+        bench_print("persistence", "record", digits, &res, &first);
+
+        bench_generator(digits, &res);
+        bench_print("generator", "prefix-2", digits, &res, &first);
+    }
+
+    printf("\n  ]\n}\n");
+
+    for (unsigned i = 0; i < BENCH_NUM_INPUTS; i++)
+        mpz_clear(inputs[i]);
+    workspace_finish(&ws);
+    power_tables_finish();
+
+    persistence_cache = cache;
+
+    return true;
+}
+
+static bool
+parse_unsigned(const char *str, unsigned *out)
+{
+    char *end;
+    errno = 0;
+    unsigned long val = strtoul(str, &end, 10);
+    if (errno || end == str || *end != '\0' || val > UINT_MAX ||
+        str[0] == '-')
+        return false;
+
+    *out = val;
+    return true;
+}
+
+/** Tuning
+ *
+ * A few choices are crossovers whose best value depends on the CPU rather
+ * than on anything we can work out: which digit histogram kernel is
+ * fastest, at what size peeling off chunks of digits loses to
+ * mpn_get_str(), and up to how many digits the batch rejection backend
+ * beats the cpu one.  --autotune times each on the machine it runs on
+ * and writes the winners to the --tuning-file, which later runs load.
+ * The file names the CPU it was made on and is ignored on any other.
+ */
+#define TUNING_VERSION 1
+/* Longer than any single measurement needs to be to beat the noise */
+#define TUNE_MIN_NS 20000000ull
+
+static const unsigned tune_chunked_limbs[] = {
+    4, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256,
+};
+#define NUM_TUNE_CHUNKED_LIMBS \
+    (sizeof(tune_chunked_limbs) / sizeof(tune_chunked_limbs[0]))
+
+static const unsigned tune_batch_digits[] = {
+    16, 32, 64, 96, 128, 160, 192, 224, 256, 288, BATCH_MAX_DIGITS,
+};
+#define NUM_TUNE_BATCH_DIGITS \
+    (sizeof(tune_batch_digits) / sizeof(tune_batch_digits[0]))
+
+/* Fills in the model name from /proc/cpuinfo or "unknown" */
+static void
+tuning_cpu_name(char *name, size_t size)
+{
+    snprintf(name, size, "unknown");
+
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    if (!f)
+        return;
+
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        char *colon = strchr(line, ':');
+        if (strncmp(line, "model name", 10) != 0 || !colon)
+            continue;
+
+        colon += strspn(colon + 1, " \t") + 1;
+        colon[strcspn(colon, "\n")] = '\0';
+        snprintf(name, size, "%s", colon);
+        break;
+    }
+    fclose(f);
+}
+
+static bool
+tuning_set_digit_kernel(const char *name)
+{
+    for (unsigned i = 0; i < NUM_DIGIT_KERNELS; i++) {
+        if (strcmp(digit_kernels[i].name, name) == 0 &&
+            digit_kernels[i].supported()) {
+            digit_kernel = &digit_kernels[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Loads a file written by tuning_save().  Must be called before any
+ * threads are started.
+ */
+static bool
+tuning_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Failed to open tuning file %s: %s\n", path,
+                strerror(errno));
+        return false;
+    }
+
+    char cpu[128], line[256];
+    tuning_cpu_name(cpu, sizeof(cpu));
+
+    unsigned version;
+    if (!fgets(line, sizeof(line), f) ||
+        sscanf(line, "persistence-tuning %u", &version) != 1 ||
+        version != TUNING_VERSION)
+        goto fail_format;
+
+    /* Check everything before applying any of it */
+    char kernel[32] = "";
+    unsigned limbs = chunked_max_limbs, digits = batch_max_digits;
+    bool same_cpu = false;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        const char *value = strchr(line, ' ');
+        if (!value)
+            goto fail_format;
+        value++;
+
+        if (strncmp(line, "cpu ", 4) == 0) {
+            same_cpu = strcmp(value, cpu) == 0;
+        } else if (strncmp(line, "digit_kernel ", 13) == 0) {
+            snprintf(kernel, sizeof(kernel), "%s", value);
+        } else if (strncmp(line, "chunked_max_limbs ", 18) == 0) {
+            if (!parse_unsigned(value, &limbs))
+                goto fail_format;
+        } else if (strncmp(line, "batch_max_digits ", 17) == 0) {
+            if (!parse_unsigned(value, &digits))
+                goto fail_format;
+        } else {
+            goto fail_format;
+        }
+    }
+    fclose(f);
+
+    if (!same_cpu) {
+        fprintf(stderr, "Tuning file %s is for another CPU; run --autotune "
+                "here to make one for %s\n", path, cpu);
+        return true;
+    }
+    if (kernel[0] && !tuning_set_digit_kernel(kernel)) {
+        fprintf(stderr, "Tuning file %s asks for digit kernel %s, which "
+                "isn't supported here\n", path, kernel);
+        return false;
+    }
+    chunked_max_limbs = limbs;
+    batch_max_digits = MIN2(digits, BATCH_MAX_DIGITS);
+
+    return true;
+
+fail_format:
+    fprintf(stderr, "Tuning file %s is corrupt\n", path);
+    fclose(f);
+    return false;
+}
+
+static bool
+tuning_write(FILE *f, void *data)
+{
+    (void)data;
+
+    char cpu[128];
+    tuning_cpu_name(cpu, sizeof(cpu));
+
+    fprintf(f, "persistence-tuning %u\n", TUNING_VERSION);
+    fprintf(f, "cpu %s\n", cpu);
+    fprintf(f, "digit_kernel %s\n", digit_kernel->name);
+    fprintf(f, "chunked_max_limbs %u\n", chunked_max_limbs);
+    fprintf(f, "batch_max_digits %u\n", batch_max_digits);
+    return true;
+}
+
+static bool
+tuning_save(const char *path)
+{
+    return atomic_write_file(path, "tuning file", tuning_write, NULL);
+}
+
+/* Picks the fastest kernel at a zero-free histogram, which is the case
+ * where they do the most work.
+ */
+static void
+tune_digit_kernel(void)
+{
+    const size_t len = 10000;
+    unsigned char *digits = malloc(len);
+    for (size_t i = 0; i < len; i++)
+        digits[i] = 7 + i % 3;
+
+    const struct digit_kernel *best = digit_kernel;
+    double best_ns = 0;
+    for (unsigned k = 0; k < NUM_DIGIT_KERNELS; k++) {
+        if (!digit_kernels[k].supported())
+            continue;
+
+        const uint64_t start = now_ns();
+        uint64_t iters = 0, ns;
+        do {
+            unsigned hist[10] = { 0, };
+            digit_kernels[k].hist(hist, digits, len);
+            iters++;
+            ns = now_ns() - start;
+        } while (ns < TUNE_MIN_NS);
+
+        const double iter_ns = (double)ns / iters;
+        fprintf(stderr, "  digit kernel %-8s %10.1f ns\n",
+                digit_kernels[k].name, iter_ns);
+        if (best_ns == 0 || iter_ns < best_ns) {
+            best = &digit_kernels[k];
+            best_ns = iter_ns;
+        }
+    }
+    digit_kernel = best;
+
+    free(digits);
+}
+
+/* Time per digit_exps() of num with a given chunked_max_limbs */
+static double
+tune_time_exps(const mpz_t num, unsigned max_limbs, mpz_t tmp,
+               struct workspace *ws)
+{
+    const unsigned saved = chunked_max_limbs;
+    chunked_max_limbs = max_limbs;
+
+    const uint64_t start = now_ns();
+    uint64_t iters = 0, ns;
+    do {
+        unsigned exps[NUM_PRIMES];
+        mpz_set(tmp, num);
+        digit_exps(exps, tmp, ws);
+        iters++;
+        ns = now_ns() - start;
+    } while (ns < TUNE_MIN_NS);
+
+    chunked_max_limbs = saved;
+    return (double)ns / iters;
+}
+
+/* Nearly every number has a zero low down, which both paths find just as
+ * fast, so the crossover is decided by the ones without.  The record
+ * family has none.
+ */
+static void
+tune_chunked(struct workspace *ws)
+{
+    mpz_t num, tmp;
+    mpz_inits(num, tmp, NULL);
+
+    unsigned best = tune_chunked_limbs[0], losses = 0;
+    for (unsigned i = 0; i < NUM_TUNE_CHUNKED_LIMBS && losses < 2; i++) {
+        const unsigned limbs = tune_chunked_limbs[i];
+        bench_record_input(num, limbs * GMP_NUMB_BITS * 0.30103);
+
+        const double chunked = tune_time_exps(num, UINT_MAX, tmp, ws);
+        const double whole = tune_time_exps(num, 0, tmp, ws);
+        fprintf(stderr, "  %3u limbs: chunked %10.1f ns, mpn_get_str() "
+                "%10.1f ns\n", limbs, chunked, whole);
+
+        /* Two losses in a row so one noisy measurement can't end it */
+        if (chunked <= whole) {
+            best = limbs;
+            losses = 0;
+        } else {
+            losses++;
+        }
+    }
+    chunked_max_limbs = best;
+
+    mpz_clears(num, tmp, NULL);
+}
+
+/* Time to search every candidate with the given number of digits */
+static double
+tune_time_search(unsigned digits, const struct reject_backend *backend,
+                 const struct search_config *config)
+{
+    const struct search_config tune_config = {
+        .min_digits = digits,
+        .max_digits = digits,
+        .threads = 1,
+        .min_persistence = config->min_persistence,
+        .power_table_mb = config->power_table_mb,
+        .output = { .format = OUTPUT_TEXT, },
+        .base = 10,
+    };
+    const struct reject_backend *saved = reject_backend;
+    reject_backend = backend;
+
+    struct search search;
+    search_init(&search, &tune_config, 1);
+    search_start(&search);
+
+    uint64_t iters = 0, ns;
+    do {
+        search_units(&search, 0, search.num_units);
+        iters++;
+        ns = now_ns() - search.start_ns;
+    } while (ns < TUNE_MIN_NS);
+
+    search_finish(&search);
+    reject_backend = saved;
+
+    return (double)ns / iters;
+}
+
+static void
+tune_batch(const struct search_config *config)
+{
+    const struct reject_backend *batch = NULL, *cpu = NULL;
+    for (unsigned i = 0; i < NUM_REJECT_BACKENDS; i++) {
+        if (strcmp(reject_backends[i].name, "batch") == 0)
+            batch = &reject_backends[i];
+        else if (strcmp(reject_backends[i].name, "cpu") == 0)
+            cpu = &reject_backends[i];
+    }
+    if (!batch || !batch->supported())
+        return;
+
+    /* Every candidate of a length goes to one backend or the other so the
+     * limit has to be lifted while we measure.
+     */
+    batch_max_digits = BATCH_MAX_DIGITS;
+
+    unsigned best = 0, losses = 0;
+    for (unsigned i = 0; i < NUM_TUNE_BATCH_DIGITS && losses < 2; i++) {
+        const unsigned digits = tune_batch_digits[i];
+        const double batch_ns = tune_time_search(digits, batch, config);
+        const double cpu_ns = tune_time_search(digits, cpu, config);
+        fprintf(stderr, "  %3u digits: batch %8.2f ms, cpu %8.2f ms\n",
+                digits, batch_ns * 1e-6, cpu_ns * 1e-6);
+
+        if (batch_ns <= cpu_ns) {
+            best = digits;
+            losses = 0;
+        } else {
+            losses++;
+        }
+    }
+    batch_max_digits = best;
+}
+
+static bool
+autotune_run(const struct search_config *config)
+{
+    /* Cache hits would just measure the cache */
+    uint64_t *cache = persistence_cache;
+    persistence_cache = NULL;
+
+    fprintf(stderr, "Timing the digit histogram kernels\n");
+    tune_digit_kernel();
+
+    power_tables_init(BENCH_MAX_DIGITS, (size_t)config->power_table_mb << 20);
+    struct workspace ws;
+    workspace_init(&ws, BENCH_MAX_DIGITS);
+
+    fprintf(stderr, "Timing chunked conversion against mpn_get_str()\n");
+    tune_chunked(&ws);
+
+    workspace_finish(&ws);
+    power_tables_finish();
+
+    fprintf(stderr, "Timing the batch rejection backend against cpu\n");
+    tune_batch(config);
+
+    persistence_cache = cache;
+
+    fprintf(stderr, "digit_kernel %s\nchunked_max_limbs %u\n"
+            "batch_max_digits %u\n", digit_kernel->name, chunked_max_limbs,
+            batch_max_digits);
+
+    return tuning_save(config->tuning_path);
+}
+
+static void
+usage(FILE *f, const char *argv0)
+{
+    fprintf(f,
+            "Usage: %s [OPTIONS]\n"
+            "\n"
+            "Searches for numbers with a high multiplicative persistence.\n"
+            "\n"
+            "  --min-digits=N         Smallest number of digits to search (default 2)\n"
+            "  --max-digits=N         Largest number of digits to search (default %u)\n"
+            "  --threads=N            Number of threads (default: all CPUs)\n"
+            "  --min-persistence=N    Smallest persistence to list (default 3)\n"
+            "  --progress-interval=N  Report progress every N digits; 0 disables\n"
+            "                         (default 100)\n"
+            "  --exponent-search      Deduplicate second-step products before\n"
+            "                         computing their persistence\n"
+            "  --checkpoint=FILE      Periodically save the search state to FILE\n"
+            "  --checkpoint-interval=N\n"
+            "                         Seconds between checkpoints (default 300)\n"
+            "  --resume               Pick up from the state saved in the\n"
+            "                         checkpoint file\n"
+            "  --serve=[HOST:]PORT    Coordinate a distributed search, handing\n"
+            "                         out work to --connect workers\n"
+            "  --connect=HOST:PORT    Work for the coordinator at HOST:PORT\n"
+            "  --lease-timeout=N      Seconds a worker has to finish a batch of\n"
+            "                         work before it's handed out again\n"
+            "                         (default 600)\n"
+            "  --power-table-mb=N     Memory for cached powers of 3, 5 and 7 in\n"
+            "                         MiB (default 256)\n"
+            "  --report-interval=N    Seconds between status lines on stderr; 0\n"
+            "                         disables them (default 60)\n"
+            "  --status-file=FILE     Keep counters and the time left in FILE in\n"
+            "                         Prometheus text format\n"
+            "  --prune                Don't finish chains whose second product is\n"
+            "                         known to fall short of --min-persistence;\n"
+            "                         count their candidates as pruned instead\n"
+            "  --prune-file=FILE      Load the known-short second products from\n"
+            "                         FILE and save them back at the end;\n"
+            "                         implies --prune\n"
+            "  --prune-mb=N           Memory for the known-short second\n"
+            "                         products in MiB (default 64)\n"
+            "  --product-store=FILE   Look up big products of digits in FILE\n"
+            "                         before evaluating them and add the new\n"
+            "                         ones at the end; may be shared by\n"
+            "                         several processes\n"
+            "  --numa=auto|on|off     Pin threads spread over the NUMA nodes,\n"
+            "                         each node with its own tables; auto only\n"
+            "                         does it with more than one node\n"
+            "  --format=text|jsonl    Print the results as text (the default) or\n"
+            "                         one JSON object per line\n"
+            "  --expand               Print every digit of each number rather\n"
+            "                         than a run length per digit\n"
+            "  --all                  Print every number of at least\n"
+            "                         --min-persistence as it's found\n"
+            "  --deterministic        Hold the --all output back and print it\n"
+            "                         sorted at the end so runs can be diffed\n"
+            "  --verify               Check the numbers printed and a sample of\n"
+            "                         the rest against the naive product of\n"
+            "                         digits\n"
+            "  --verify-sample=N      Check one in N of the other candidates\n"
+            "                         with --verify; 0 for none (default\n"
+            "                         10000)\n"
+            "  --base=N               Search in base N, from 2 to 36 (default\n"
+            "                         10); bases other than 10 take a slower,\n"
+            "                         generic path\n"
+            "  --census               Also count every number by its number of\n"
+            "                         digits and persistence; takes memory\n"
+            "                         growing with the cube of --max-digits\n"
+            "  --reject-backend=NAME  Backend for the first step of every\n"
+            "                         candidate (default: the best one which\n"
+            "                         works here; available: batch, cpu)\n"
+            "  --pipeline             Hand survivors of the first step between\n"
+            "                         threads through a queue so the threads\n"
+            "                         split their time between the two stages\n"
+            "  --tuning-file=FILE     Load the crossovers tuned for this CPU\n"
+            "                         from FILE\n"
+            "  --bench                Time the kernels and print the results as\n"
+            "                         JSON instead of searching\n"
+            "  --autotune             Time the crossovers here and write them\n"
+            "                         to the --tuning-file instead of searching\n"
+            "  --help                 Print this message\n",
+            argv0, MAX_DIGITS);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct search_config config = {
+        .min_digits = 2,
+        .max_digits = MAX_DIGITS,
+        .threads = 0,
+        .min_persistence = 3,
+        .progress_interval = 100,
+        .exponent_search = false,
+        .checkpoint_path = NULL,
+        .checkpoint_interval = 300,
+        .resume = false,
+        .serve_addr = NULL,
+        .connect_addr = NULL,
+        .lease_timeout = 600,
+        .power_table_mb = 256,
+        .report_interval = 60,
+        .status_path = NULL,
+        .prune = false,
+        .prune_path = NULL,
+        .prune_mb = 64,
+        .store_path = NULL,
+        .numa = NUMA_AUTO,
+        .tuning_path = NULL,
+        .output = {
+            .format = OUTPUT_TEXT,
+            .expand = false,
+            .all = false,
+        },
+        .reject_backend = NULL,
+        .census = false,
+        .pipeline = false,
+        .deterministic = false,
+        .verify = false,
+        .verify_sample = 10000,
+        .base = 10,
+    };
+
+    enum {
+        OPT_MIN_DIGITS = 256,
+        OPT_MAX_DIGITS,
+        OPT_THREADS,
+        OPT_MIN_PERSISTENCE,
+        OPT_PROGRESS_INTERVAL,
+        OPT_CHECKPOINT_INTERVAL,
+        OPT_LEASE_TIMEOUT,
+        OPT_POWER_TABLE_MB,
+        OPT_REPORT_INTERVAL,
+        OPT_PRUNE_MB,
+        OPT_VERIFY_SAMPLE,
+        OPT_BASE,
+        OPT_EXPONENT_SEARCH,
+        OPT_CHECKPOINT,
+        OPT_RESUME,
+        OPT_SERVE,
+        OPT_CONNECT,
+        OPT_STATUS_FILE,
+        OPT_PRUNE,
+        OPT_PRUNE_FILE,
+        OPT_PRODUCT_STORE,
+        OPT_NUMA,
+        OPT_TUNING_FILE,
+        OPT_FORMAT,
+        OPT_EXPAND,
+        OPT_ALL,
+        OPT_DETERMINISTIC,
+        OPT_VERIFY,
+        OPT_REJECT_BACKEND,
+        OPT_PIPELINE,
+        OPT_CENSUS,
+        OPT_BENCH,
+        OPT_AUTOTUNE,
+        OPT_HELP,
+    };
+    static const struct option long_options[] = {
+        { "min-digits",           required_argument, NULL, OPT_MIN_DIGITS },
+        { "max-digits",           required_argument, NULL, OPT_MAX_DIGITS },
+        { "threads",              required_argument, NULL, OPT_THREADS },
+        { "min-persistence",      required_argument, NULL, OPT_MIN_PERSISTENCE },
+        { "progress-interval",    required_argument, NULL, OPT_PROGRESS_INTERVAL },
+        { "checkpoint-interval",  required_argument, NULL, OPT_CHECKPOINT_INTERVAL },
+        { "lease-timeout",        required_argument, NULL, OPT_LEASE_TIMEOUT },
+        { "power-table-mb",       required_argument, NULL, OPT_POWER_TABLE_MB },
+        { "report-interval",      required_argument, NULL, OPT_REPORT_INTERVAL },
+        { "prune-mb",             required_argument, NULL, OPT_PRUNE_MB },
+        { "verify-sample",        required_argument, NULL, OPT_VERIFY_SAMPLE },
+        { "base",                 required_argument, NULL, OPT_BASE },
+        { "exponent-search",      no_argument,       NULL, OPT_EXPONENT_SEARCH },
+        { "checkpoint",           required_argument, NULL, OPT_CHECKPOINT },
+        { "resume",               no_argument,       NULL, OPT_RESUME },
+        { "serve",                required_argument, NULL, OPT_SERVE },
+        { "connect",              required_argument, NULL, OPT_CONNECT },
+        { "status-file",          required_argument, NULL, OPT_STATUS_FILE },
+        { "prune",                no_argument,       NULL, OPT_PRUNE },
+        { "prune-file",           required_argument, NULL, OPT_PRUNE_FILE },
+        { "product-store",        required_argument, NULL, OPT_PRODUCT_STORE },
+        { "numa",                 required_argument, NULL, OPT_NUMA },
+        { "tuning-file",          required_argument, NULL, OPT_TUNING_FILE },
+        { "format",               required_argument, NULL, OPT_FORMAT },
+        { "expand",               no_argument,       NULL, OPT_EXPAND },
+        { "all",                  no_argument,       NULL, OPT_ALL },
+        { "deterministic",        no_argument,       NULL, OPT_DETERMINISTIC },
+        { "verify",               no_argument,       NULL, OPT_VERIFY },
+        { "reject-backend",       required_argument, NULL, OPT_REJECT_BACKEND },
+        { "pipeline",             no_argument,       NULL, OPT_PIPELINE },
+        { "census",               no_argument,       NULL, OPT_CENSUS },
+        { "bench",                no_argument,       NULL, OPT_BENCH },
+        { "autotune",             no_argument,       NULL, OPT_AUTOTUNE },
+        { "help",                 no_argument,       NULL, OPT_HELP },
+        { NULL, 0, NULL, 0 },
+    };
+
+    bool bench = false, autotune = false;
+    int opt, opt_index;
+    while ((opt = getopt_long(argc, argv, "", long_options,
+                              &opt_index)) != -1) {
+        unsigned *val = NULL;
+        switch (opt) {
+        case OPT_MIN_DIGITS:        val = &config.min_digits; break;
+        case OPT_MAX_DIGITS:        val = &config.max_digits; break;
+        case OPT_THREADS:           val = &config.threads; break;
+        case OPT_MIN_PERSISTENCE:   val = &config.min_persistence; break;
+        case OPT_PROGRESS_INTERVAL: val = &config.progress_interval; break;
+        case OPT_CHECKPOINT_INTERVAL: val = &config.checkpoint_interval; break;
+        case OPT_LEASE_TIMEOUT:     val = &config.lease_timeout; break;
+        case OPT_POWER_TABLE_MB:    val = &config.power_table_mb; break;
+        case OPT_REPORT_INTERVAL:   val = &config.report_interval; break;
+        case OPT_PRUNE_MB:          val = &config.prune_mb; break;
+        case OPT_VERIFY_SAMPLE:     val = &config.verify_sample; break;
+        case OPT_BASE:              val = &config.base; break;
+        case OPT_EXPONENT_SEARCH:
+            config.exponent_search = true;
+            continue;
+        case OPT_CHECKPOINT:
+            config.checkpoint_path = optarg;
+            continue;
+        case OPT_RESUME:
+            config.resume = true;
+            continue;
+        case OPT_SERVE:
+            config.serve_addr = optarg;
+            continue;
+        case OPT_CONNECT:
+            config.connect_addr = optarg;
+            continue;
+        case OPT_STATUS_FILE:
+            config.status_path = optarg;
+            continue;
+        case OPT_PRUNE:
+            config.prune = true;
+            continue;
+        case OPT_PRUNE_FILE:
+            config.prune = true;
+            config.prune_path = optarg;
+            continue;
+        case OPT_PRODUCT_STORE:
+            config.store_path = optarg;
+            continue;
+        case OPT_NUMA:
+            if (strcmp(optarg, "auto") == 0) {
+                config.numa = NUMA_AUTO;
+            } else if (strcmp(optarg, "on") == 0) {
+                config.numa = NUMA_ON;
+            } else if (strcmp(optarg, "off") == 0) {
+                config.numa = NUMA_OFF;
+            } else {
+                fprintf(stderr, "%s: invalid value for --numa: %s\n",
+                        argv[0], optarg);
+                return 1;
+            }
+            continue;
+        case OPT_FORMAT:
+            if (strcmp(optarg, "text") == 0) {
+                config.output.format = OUTPUT_TEXT;
+            } else if (strcmp(optarg, "jsonl") == 0) {
+                config.output.format = OUTPUT_JSONL;
+            } else {
+                fprintf(stderr, "%s: invalid value for --format: %s\n",
+                        argv[0], optarg);
+                return 1;
+            }
+            continue;
+        case OPT_EXPAND:
+            config.output.expand = true;
+            continue;
+        case OPT_ALL:
+            config.output.all = true;
+            continue;
+        case OPT_DETERMINISTIC:
+            config.deterministic = true;
+            continue;
+        case OPT_VERIFY:
+            config.verify = true;
+            continue;
+        case OPT_REJECT_BACKEND:
+            config.reject_backend = optarg;
+            continue;
+        case OPT_PIPELINE:
+            config.pipeline = true;
+            continue;
+        case OPT_CENSUS:
+            config.census = true;
+            continue;
+        case OPT_BENCH:
+            bench = true;
+            continue;
+        case OPT_AUTOTUNE:
+            autotune = true;
+            continue;
+        case OPT_TUNING_FILE:
+            config.tuning_path = optarg;
+            continue;
+        case OPT_HELP:
+            usage(stdout, argv[0]);
+            return 0;
+        default:
+            usage(stderr, argv[0]);
+            return 1;
+        }
+
+        if (!parse_unsigned(optarg, val)) {
+            fprintf(stderr, "%s: invalid value for --%s: %s\n", argv[0],
+                    long_options[opt_index].name, optarg);
+            return 1;
+        }
+    }
+
+    if (optind < argc) {
+        usage(stderr, argv[0]);
+        return 1;
+    }
+
+    /* Single-digit numbers don't take the prefix scheme into account */
+    if (config.min_digits < 2)
+        config.min_digits = 2;
+
+    if (config.max_digits < config.min_digits) {
+        fprintf(stderr, "%s: --max-digits must be at least --min-digits\n",
+                argv[0]);
+        return 1;
+    }
+
+#ifdef USE_OPENMP
+    if (config.threads)
+        omp_set_num_threads(config.threads);
+#else
+    if (config.threads > 1) {
+        fprintf(stderr, "%s: built without OpenMP; --threads must be 1\n",
+                argv[0]);
+        return 1;
+    }
+#endif
+
+    if (config.resume && !config.checkpoint_path) {
+        fprintf(stderr, "%s: --resume requires --checkpoint\n", argv[0]);
+        return 1;
+    }
+
+    if (config.serve_addr && config.connect_addr) {
+        fprintf(stderr, "%s: --serve and --connect are mutually exclusive\n",
+                argv[0]);
+        return 1;
+    }
+    if (config.connect_addr && config.checkpoint_path) {
+        fprintf(stderr, "%s: workers don't checkpoint; use --checkpoint on "
+                "the coordinator\n", argv[0]);
+        return 1;
+    }
+    if (config.lease_timeout == 0)
+        config.lease_timeout = 1;
+
+    /* Exponent search only keeps the smallest candidate for each second
+     * product and the coordinator doesn't see candidates at all.
+     */
+    if (config.output.all && (config.exponent_search || config.serve_addr)) {
+        fprintf(stderr, "%s: --all doesn't work with --exponent-search or "
+                "--serve\n", argv[0]);
+        return 1;
+    }
+    /* What --deterministic holds back isn't in the checkpoint so a resumed
+     * run would never print it
+     */
+    if (config.deterministic && config.checkpoint_path) {
+        fprintf(stderr, "%s: --deterministic doesn't work with "
+                "--checkpoint\n", argv[0]);
+        return 1;
+    }
+
+    /* The census needs the persistence of every candidate of every length
+     * and is only kept in memory.
+     */
+    if (config.census) {
+        if (config.min_digits > 2) {
+            fprintf(stderr, "%s: --census counts every number from 1 digit "
+                    "up; --min-digits doesn't apply\n", argv[0]);
+            return 1;
+        }
+        if (config.exponent_search || config.prune || config.serve_addr ||
+            config.connect_addr || config.checkpoint_path) {
+            fprintf(stderr, "%s: --census doesn't work with "
+                    "--exponent-search, --prune, --serve, --connect or "
+                    "--checkpoint\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (config.base < 2 || config.base > MAX_BASE) {
+        fprintf(stderr, "%s: --base must be from 2 to %u\n", argv[0],
+                MAX_BASE);
+        return 1;
+    }
+    /* The generic search is a plain in-memory run */
+    if (config.base != 10 &&
+        (config.exponent_search || config.prune || config.serve_addr ||
+         config.connect_addr || config.checkpoint_path || config.census ||
+         config.output.all || config.status_path || config.store_path ||
+         config.pipeline || config.verify)) {
+        fprintf(stderr, "%s: --base other than 10 doesn't work with "
+                "--exponent-search, --prune, --serve, --connect, "
+                "--checkpoint, --census, --all, --status-file, "
+                "--product-store, --pipeline or --verify\n", argv[0]);
+        return 1;
+    }
+
+    if (autotune && !config.tuning_path) {
+        fprintf(stderr, "%s: --autotune needs a --tuning-file to write\n",
+                argv[0]);
+        return 1;
+    }
+
+    /* A worker going away shouldn't take the coordinator with it */
+    if (config.serve_addr || config.connect_addr)
+        signal(SIGPIPE, SIG_IGN);
+
+    numa_init(config.numa);
+    select_digit_kernel();
+    if (!select_reject_backend(config.reject_backend))
+        return 1;
+    if (config.tuning_path && !autotune && !tuning_load(config.tuning_path))
+        return 1;
+    persistence_cache = calloc(1ull << CACHE_BITS, sizeof(*persistence_cache));
+    if (config.store_path && !store_open(config.store_path))
+        return 1;
+
+    bool ok;
+    if (autotune)
+        ok = autotune_run(&config);
+    else if (bench)
+        ok = bench_run(&config);
+    else if (config.serve_addr)
+        ok = serve_run(&config);
+    else if (config.connect_addr)
+        ok = worker_run(&config);
+    else if (config.base != 10)
+        ok = base_search_run(&config);
+    else
+        ok = search_run(&config);
+
+    if (config.verify && !bench && !autotune)
+        ok = verify_report() && ok;
+
+    /* What was learned is right even if the search failed */
+    if (config.store_path && !bench && !autotune)
+        ok = store_save(config.store_path) && ok;
+    store_close();
+    free(persistence_cache);
+    numa_finish();
+
+    return ok ? 0 : 1;
+}
+
+#endif /* PERSISTENCE_LIBRARY */
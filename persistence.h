@@ -0,0 +1,136 @@
+/*
+ * Copyright © 2019 Jason Ekstrand
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/** libpersistence
+ *
+ * The search behind the persistence program as a library.  A context holds
+ * the options of a search along with everything that's worth keeping
+ * between calls: the tables of powers, the persistence cache and scratch
+ * space.  Create one, then search ranges of its units, walk them by hand or
+ * ask for the persistence of arbitrary numbers for as long as you like.
+ *
+ * The search is split into units, each a slice of the candidates with one
+ * number of digits, numbered in a fixed order for a given set of options.
+ * Any partition of [0, persistence_num_units()) covers the whole search
+ * exactly once, so a scheduler can hand out ranges of units to contexts in
+ * as many processes as it likes and add up the summaries.
+ *
+ * Candidates are the smallest numbers for their product of digits with no
+ * 0s or 1s, written as how many of each digit they have since their digits
+ * are always in ascending order.  Numbers whose product is a multiple of
+ * the base aren't candidates.
+ *
+ * The tables and the cache are shared by every context in the process.  A
+ * context may only be used by one thread at a time, although a search
+ * runs on as many threads as the context was asked for.
+ */
+#ifndef PERSISTENCE_H
+#define PERSISTENCE_H
+
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PERSISTENCE_MAX_BASE 36
+/* Persistences are below this */
+#define PERSISTENCE_MAX 32
+
+struct persistence_options {
+    /* 0 means all CPUs; at most 1 in a build without OpenMP */
+    unsigned threads;
+    /* Lengths of the candidates to search, at least 2 */
+    unsigned min_digits;
+    unsigned max_digits;
+    /* From 2 to PERSISTENCE_MAX_BASE; other than 10 is much slower */
+    unsigned base;
+    /* Candidates of at least this persistence go to the callback */
+    unsigned min_persistence;
+    /* Memory cap for the tables of powers, in MiB */
+    unsigned power_table_mb;
+};
+
+struct persistence_number {
+    unsigned base;
+    unsigned digits;
+    /* How many of each digit, in ascending order */
+    unsigned count[PERSISTENCE_MAX_BASE];
+};
+
+/* Counts of candidates by persistence and the smallest of each */
+struct persistence_summary {
+    uint64_t count[PERSISTENCE_MAX];
+    struct persistence_number smallest[PERSISTENCE_MAX];
+};
+
+/* Called with each candidate of at least min_persistence.  Calls are made
+ * from the search threads but never more than one at a time.
+ */
+typedef void (*persistence_found_fn)(void *data, unsigned persistence,
+                                     const struct persistence_number *num);
+
+struct persistence_ctx;
+struct persistence_iter;
+
+/* Fills in the same defaults as the persistence program */
+void persistence_options_init(struct persistence_options *opts);
+
+/* Returns NULL with errno set to EINVAL if the options are out of range or
+ * ask for more than one thread without OpenMP, or ENOMEM.  Nothing is
+ * printed either way.
+ */
+struct persistence_ctx *
+persistence_ctx_create(const struct persistence_options *opts);
+void persistence_ctx_destroy(struct persistence_ctx *ctx);
+
+/* Number of steps it takes n to get to a single digit in the context's
+ * base
+ */
+unsigned persistence_of(struct persistence_ctx *ctx, const mpz_t n);
+
+uint64_t persistence_num_units(const struct persistence_ctx *ctx);
+
+/* Searches units [begin, end) and adds what it finds to summary, which
+ * must start out zeroed.  found may be NULL.
+ */
+bool persistence_search(struct persistence_ctx *ctx, uint64_t begin,
+                        uint64_t end, persistence_found_fn found, void *data,
+                        struct persistence_summary *summary);
+
+/* Walks the candidates of units [begin, end) in order */
+struct persistence_iter *
+persistence_iter_create(struct persistence_ctx *ctx, uint64_t begin,
+                        uint64_t end);
+/* Sets num to the next candidate and, unless it's NULL, product to its
+ * product of digits.  Returns false once there are no more.
+ */
+bool persistence_iter_next(struct persistence_iter *it,
+                           struct persistence_number *num, mpz_ptr product);
+void persistence_iter_destroy(struct persistence_iter *it);
+
+/* Sets out to the value of num */
+void persistence_number_get_mpz(mpz_t out,
+                                const struct persistence_number *num);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PERSISTENCE_H */